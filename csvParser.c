@@ -4,21 +4,41 @@ See LICENCE at https://github.com/ChrisMcGowanAu/csvParser
 Copyright (c) 2024 Chris McGowan
 ***************************************/
 
+// For clock_gettime, pthreads etc when built with -std=c17
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "csvParser.h"
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifdef __cplusplus
 #include <cstdio>
 #include <cstring>
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define LINEMAX 32 * 1024
 // DEBUGME can be 0 1 2 3 4 5
-#define DEBUGME 2
+// Set it from the build, eg -DDEBUGME=2, rather than editing it here
+#ifndef DEBUGME
+#define DEBUGME 0
+#endif
 
 const uint32_t excelStartDQ = 0xE2809C;
 const uint32_t excelEndDQ = 0xE2809D;
@@ -28,30 +48,168 @@ const uint8_t altDquote = 0xe2;
 
 typedef struct CellType {
   CsvCellType cell;
+  // cellContents belongs to a column dictionary, not this cell
+  bool interned;
   struct CellType *next;
 } CellType;
 
 typedef struct RowType {
-  uint32_t rowId;
+  uint64_t rowId;
   uint32_t numCols;
   // List of cells in this row
   struct CellType *first;
+  struct CellType *last;
   // linked list of Rows
-  struct RowType *prev; // may not be needed
   struct RowType *next;
 } RowType;
 
-void freeCell(CellType *cellPtr) {
+////////////////////////////////////////////////////
+// Dictionary for one column. Each distinct value is stored once and
+// the cells of the column point at it. codes[row] is the index of the
+// row's value in strings, or CSV_NO_CODE if the row is too short.
+// slots is an open addressing table of (code + 1), 0 is empty.
+////////////////////////////////////////////////////
+typedef struct CsvDict {
+  uint32_t col;
+  uint32_t nStrings;
+  uint32_t capStrings;
+  char **strings;
+  uint32_t *lens;
+  uint32_t *slots;
+  uint32_t mask;
+  uint32_t *codes;
+  uint32_t nCodes;
+  uint32_t capCodes;
+} CsvDict;
+
+////////////////////////////////////////////////////
+// Snapshot file layout. Everything is found by its offset from the
+// start of the file, so the file can be mapped anywhere and shared.
+//   SnapHeader
+//   uint64_t firstCell[numRows + 1] -- row r is cells firstCell[r] ..
+//                                      firstCell[r + 1] - 1
+//   SnapCell cells[nCells]
+//   cell text, each '\0' terminated
+////////////////////////////////////////////////////
+#define SNAPMAGIC "CSVSNAP1"
+// Version 2 fills in SnapCell.flags, version 1 left them 0
+#define SNAPVERSION 2
+
+typedef struct SnapHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerBytes;
+  uint64_t numRows;
+  uint64_t numCols;
+  uint64_t nCells;
+  uint64_t rowsOffset;
+  uint64_t cellsOffset;
+  uint64_t dataOffset;
+  uint64_t fileBytes;
+} SnapHeader;
+
+typedef struct SnapCell {
+  uint64_t offset; // of the text, 0 for an empty cell
+  uint32_t bytes;
+  uint32_t flags; // the cell's CSV_CELL_... bits
+} SnapCell;
+
+static const uint64_t *snapRows(CsvType *csv) {
+  const SnapHeader *header = (const SnapHeader *)csv->snapshot;
+  return (const uint64_t *)(csv->snapshot + header->rowsOffset);
+}
+
+static const SnapCell *snapCells(CsvType *csv) {
+  const SnapHeader *header = (const SnapHeader *)csv->snapshot;
+  return (const SnapCell *)(csv->snapshot + header->cellsOffset);
+}
+
+// The text of a snapshot cell, nullptr if empty (or corrupt)
+static const char *snapText(CsvType *csv, const SnapCell *snapCell) {
+  if (snapCell->offset == 0 ||
+      snapCell->offset + snapCell->bytes >= csv->snapshotBytes) {
+    return nullptr;
+  }
+  return csv->snapshot + snapCell->offset;
+}
+
+////////////////////////////////////////////////////
+// Memory for the csv tree, from its allocator. Counted in the stats
+// of the tree. A failure sets csv->outOfMemory, which ends the load.
+////////////////////////////////////////////////////
+static void *defaultAlloc(void *ctx, size_t bytes) {
+  (void)ctx;
+  return malloc(bytes);
+}
+
+static void *defaultRealloc(void *ctx, void *ptr, size_t bytes) {
+  (void)ctx;
+  return realloc(ptr, bytes);
+}
+
+static void defaultFree(void *ctx, void *ptr) {
+  (void)ctx;
+  free(ptr);
+}
+
+static const CsvAllocator defaultAllocator = {defaultAlloc, defaultRealloc,
+                                              defaultFree, nullptr};
+
+static void *csvMalloc(CsvType *csv, size_t bytes) {
+  csv->stats.allocCount++;
+  csv->stats.allocBytes += bytes;
+  void *ptr = csv->allocator.alloc(csv->allocator.ctx, bytes);
+  if (ptr == nullptr) {
+    csv->outOfMemory = true;
+  }
+  return ptr;
+}
+
+static void *csvCalloc(CsvType *csv, size_t count, size_t bytes) {
+  if (bytes != 0 && count > SIZE_MAX / bytes) {
+    csv->outOfMemory = true;
+    return nullptr;
+  }
+  void *ptr = csvMalloc(csv, count * bytes);
+  if (ptr != nullptr) {
+    memset(ptr, 0, count * bytes);
+  }
+  return ptr;
+}
+
+static void *csvRealloc(CsvType *csv, void *ptr, size_t bytes) {
+  csv->stats.allocCount++;
+  csv->stats.allocBytes += bytes;
+  void *newPtr = csv->allocator.realloc(csv->allocator.ctx, ptr, bytes);
+  if (newPtr == nullptr) {
+    csv->outOfMemory = true;
+  }
+  return newPtr;
+}
+
+static void csvFree(CsvType *csv, void *ptr) {
+  if (ptr != nullptr) {
+    csv->allocator.free(csv->allocator.ctx, ptr);
+  }
+}
+
+static uint64_t nowNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void freeCell(CsvType *csv, CellType *cellPtr) {
   if (cellPtr == nullptr) {
     return;
   }
-  if (cellPtr->cell.cellContents != nullptr) {
-    free(cellPtr->cell.cellContents);
+  if (cellPtr->cell.cellContents != nullptr && !cellPtr->interned) {
+    csvFree(csv, cellPtr->cell.cellContents);
   }
-  free(cellPtr);
+  csvFree(csv, cellPtr);
 }
 
-static void freeRow(RowType *rowPtr) {
+static void freeRow(CsvType *csv, RowType *rowPtr) {
   if (rowPtr == nullptr) {
     return;
   }
@@ -59,74 +217,106 @@ static void freeRow(RowType *rowPtr) {
   CellType *nextPtr = nullptr;
   while (colPtr != nullptr) {
     nextPtr = colPtr->next;
-    freeCell(colPtr);
+    freeCell(csv, colPtr);
     colPtr = nextPtr;
   }
-  free(rowPtr);
+  csvFree(csv, rowPtr);
+}
+
+static void freeDicts(CsvType *csv) {
+  for (uint32_t d = 0; d < csv->nDicts; d++) {
+    CsvDict *dict = &csv->dicts[d];
+    for (uint32_t s = 0; s < dict->nStrings; s++) {
+      csvFree(csv, dict->strings[s]);
+    }
+    csvFree(csv, dict->strings);
+    csvFree(csv, dict->lens);
+    csvFree(csv, dict->slots);
+    csvFree(csv, dict->codes);
+  }
+  csvFree(csv, csv->dicts);
 }
 
+// The CsvType itself goes last, back to the allocator it came from
+static void freeCsv(CsvType *csv) {
+  CsvAllocator allocator = csv->allocator;
+  allocator.free(allocator.ctx, csv);
+}
 
 void freeMem(CsvType *csv) {
     if (csv == NULL) {
         return;
     }
 
-    RowType *rowPtr = csv->firstRow;
-    while (rowPtr != NULL) {
-        RowType *nextPtr = rowPtr->next;
-        freeRow(rowPtr);
-        rowPtr = nextPtr;
-    }
-
-    free(csv->rowLookup);
-    free(csv);
-}
-
-static uint32_t countCols(RowType *rowPtr) {
-    uint32_t nCols = 0;
-
-    if (rowPtr == NULL) {
-        return nCols;
+    if (csv->snapshot != nullptr) {
+        munmap((void *)csv->snapshot, csv->snapshotBytes);
+        freeCsv(csv);
+        return;
     }
 
-    for (CellType *cell = rowPtr->first; cell != NULL; cell = cell->next) {
-        nCols++;
+    for (uint64_t r = 0; r < csv->numRows64; r++) {
+        freeRow(csv, csv->rowLookup[r]);
     }
 
-    return nCols;
+    freeDicts(csv);
+    csvFree(csv, csv->errors);
+    csvFree(csv, csv->rowLookup);
+    freeCsv(csv);
 }
 
-static void countRowsAndCols(CsvType *csv) {
-    csv->numRows = 0;
-    csv->numCols = 0;
-
-    for (RowType *row = csv->firstRow; row != NULL; row = row->next) {
-        uint32_t cols = countCols(row);
-        row->numCols = cols;
-
-        if (cols > csv->numCols) {
-            csv->numCols = cols;
-        }
-
-        csv->numRows++;
-    }
+////////////////////////////////////////////////////
+// getCell for a csv opened from a snapshot
+////////////////////////////////////////////////////
+static CsvCellType getSnapCell(CsvType *csv, uint64_t row, uint32_t col) {
+  CsvCellType cell;
+  cell.status = missingCol;
+  cell.lastCellInRow = true;
+  cell.flags = 0;
+  cell.bytes = 0;
+  cell.cellContents = nullptr;
+  const uint64_t *rows = snapRows(csv);
+  uint64_t nCols = rows[row + 1] - rows[row];
+  if (col >= nCols) {
+    return cell;
+  }
+  const SnapCell *snapCell = &snapCells(csv)[rows[row] + col];
+  const char *text = snapText(csv, snapCell);
+  cell.lastCellInRow = (col + 1 == nCols);
+  if (text == nullptr) {
+    cell.status = emptyCell;
+    return cell;
+  }
+  cell.status = normalCell;
+  cell.bytes = snapCell->bytes;
+  cell.flags = (uint8_t)snapCell->flags;
+  // The mapping is read only, the text must not be changed
+  cell.cellContents = (char *)text;
+  return cell;
 }
 
 // rows and cols use C convention, the first is indexed '0'
 // If comparing with excel or libre office rows and cols, they use 1 .. n
 // not 0 .. (n-1)
 CsvCellType getCell(CsvType *csv, uint32_t row, uint32_t col) {
+  return getCell64(csv, row, col);
+}
+
+CsvCellType getCell64(CsvType *csv, uint64_t row, uint32_t col) {
   CsvCellType cell;
-  if (csv == NULL || csv->rowLookup == NULL || row >= csv->numRows) {
-    cell.status = missingRow;
-    return cell;
-  }
   cell.status = emptyCell;
   cell.lastCellInRow = true;
+  cell.flags = 0;
   cell.bytes = 0;
   cell.cellContents = nullptr;
+  if (csv != NULL && csv->snapshot != nullptr && row < csv->numRows64) {
+    return getSnapCell(csv, row, col);
+  }
+  if (csv == NULL || csv->rowLookup == NULL || row >= csv->numRows64) {
+    cell.status = missingRow;
+    return cell;
+  }
   RowType *rowPtr = csv->rowLookup[row];
-  uint32_t rowNumber = 0;
+  uint64_t rowNumber = 0;
   if (rowPtr == nullptr) {
     if (DEBUGME > 1)
       fprintf(stderr, "No Rows defined\n");
@@ -136,7 +326,7 @@ CsvCellType getCell(CsvType *csv, uint32_t row, uint32_t col) {
   rowNumber = rowPtr->rowId;
   if (rowNumber != row) {
     if (DEBUGME > 0)
-      fprintf(stderr, "row %u not found\n", row);
+      fprintf(stderr, "row %llu not found\n", (unsigned long long)row);
     cell.status = missingRow;
     return (cell);
   }
@@ -145,7 +335,7 @@ CsvCellType getCell(CsvType *csv, uint32_t row, uint32_t col) {
   if (colCellPtr == nullptr) {
     rowPtr->numCols = 0;
     if (DEBUGME > 1)
-      fprintf(stderr, "No columns for row %u\n", row);
+      fprintf(stderr, "No columns for row %llu\n", (unsigned long long)row);
     cell.status = missingCol;
     return (cell);
   }
@@ -156,7 +346,8 @@ CsvCellType getCell(CsvType *csv, uint32_t row, uint32_t col) {
   }
   if (colNumber != col) {
     if (DEBUGME > 4)
-      fprintf(stderr, "columns %u for row %u not found\n", col, row);
+      fprintf(stderr, "columns %u for row %llu not found\n", col,
+              (unsigned long long)row);
     cell.status = missingCol;
     return (cell);
   } else {
@@ -177,299 +368,3783 @@ CsvCellType getCell(CsvType *csv, uint32_t row, uint32_t col) {
   return (cell);
 }
 
-static void parseLine(CsvType *csv, char *buffer, char sep) {
-  // search for a seperator
-  // This tries to identify some 8 bit double quote excel generates.
-  // There is two, a start and end type. macros -- excelStartDQ and excelEndDQ
-  // This is not part of the csv standard
-  //
-  // the static currLastRow is to remember the current last row added
-  // It gets reset when
-  static RowType *currLastRow = nullptr;
+////////////////////////////////////////////////////
+// Hash the bytes of a cell, 8 bytes at a time
+////////////////////////////////////////////////////
+static uint64_t hashBytes(const char *bytes, uint32_t len) {
+  const uint64_t mult = 0x9E3779B97F4A7C15ULL;
+  uint64_t h = len * mult;
+  uint32_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    h = (h ^ word) * mult;
+    h ^= h >> 29;
+  }
+  uint64_t tail = 0;
+  for (uint32_t shift = 0; i < len; i++, shift += 8) {
+    tail |= (uint64_t)(uint8_t)bytes[i] << shift;
+  }
+  h = (h ^ tail) * mult;
+  h ^= h >> 32;
+  h *= 0xD6E8FEB86659FD93ULL;
+  h ^= h >> 32;
+  return h;
+}
+
+////////////////////////////////////////////////////
+// The dictionary for col, or nullptr if col is not encoded
+////////////////////////////////////////////////////
+static CsvDict *findDict(CsvType *csv, uint32_t col) {
+  for (uint32_t d = 0; d < csv->nDicts; d++) {
+    if (csv->dicts[d].col == col) {
+      return &csv->dicts[d];
+    }
+  }
+  return nullptr;
+}
+
+static void growDictSlots(CsvType *csv, CsvDict *dict) {
+  uint32_t nSlots = dict->slots ? 2 * (dict->mask + 1) : 64;
+  uint32_t *slots = (uint32_t *)csvCalloc(csv, nSlots, sizeof(uint32_t));
+  if (slots == nullptr) {
+    // The old table is still good, only fuller
+    return;
+  }
+  uint32_t mask = nSlots - 1;
+  for (uint32_t code = 0; code < dict->nStrings; code++) {
+    uint32_t pos = (uint32_t)hashBytes(dict->strings[code], dict->lens[code]);
+    while (slots[pos & mask] != 0) {
+      pos++;
+    }
+    slots[pos & mask] = code + 1;
+  }
+  csvFree(csv, dict->slots);
+  dict->slots = slots;
+  dict->mask = mask;
+}
+
+////////////////////////////////////////////////////
+// Return the code of a value, adding it to the dictionary if it is new.
+// CSV_NO_CODE if there is no memory to add it.
+////////////////////////////////////////////////////
+static uint32_t internString(CsvType *csv, CsvDict *dict, const char *value,
+                             uint32_t len) {
+  uint32_t pos = (uint32_t)hashBytes(value, len);
+  for (;; pos++) {
+    uint32_t slot = dict->slots[pos & dict->mask];
+    if (slot == 0) {
+      break;
+    }
+    uint32_t code = slot - 1;
+    if (dict->lens[code] == len && memcmp(dict->strings[code], value, len) == 0) {
+      return code;
+    }
+  }
+  if (dict->nStrings == dict->capStrings) {
+    uint32_t capStrings = dict->capStrings ? 2 * dict->capStrings : 16;
+    char **strings = (char **)csvRealloc(csv, dict->strings,
+                                         capStrings * sizeof(char *));
+    if (strings == nullptr) {
+      return CSV_NO_CODE;
+    }
+    dict->strings = strings;
+    uint32_t *lens = (uint32_t *)csvRealloc(csv, dict->lens,
+                                            capStrings * sizeof(uint32_t));
+    if (lens == nullptr) {
+      return CSV_NO_CODE;
+    }
+    dict->lens = lens;
+    dict->capStrings = capStrings;
+  }
+  uint32_t code = dict->nStrings;
+  dict->strings[code] = (char *)csvMalloc(csv, len + 1);
+  if (dict->strings[code] == nullptr) {
+    return CSV_NO_CODE;
+  }
+  memcpy(dict->strings[code], value, len);
+  dict->strings[code][len] = '\0';
+  dict->lens[code] = len;
+  dict->nStrings++;
+  dict->slots[pos & dict->mask] = code + 1;
+  // Keep the table at most half full
+  if (2 * dict->nStrings > dict->mask) {
+    growDictSlots(csv, dict);
+  }
+  return code;
+}
+
+////////////////////////////////////////////////////
+// Every new row starts with no value in the encoded columns
+////////////////////////////////////////////////////
+static void addDictRow(CsvType *csv) {
+  for (uint32_t d = 0; d < csv->nDicts; d++) {
+    CsvDict *dict = &csv->dicts[d];
+    if (dict->nCodes == UINT32_MAX - 1) {
+      // No codes past 32 bit row ids, csvColumnCodes() gives none
+      continue;
+    }
+    if (dict->nCodes == dict->capCodes) {
+      uint32_t capCodes = dict->capCodes ? 2 * dict->capCodes : 1024;
+      uint32_t *codes = (uint32_t *)csvRealloc(csv, dict->codes,
+                                               capCodes * sizeof(uint32_t));
+      if (codes == nullptr) {
+        continue;
+      }
+      dict->codes = codes;
+      dict->capCodes = capCodes;
+    }
+    dict->codes[dict->nCodes++] = CSV_NO_CODE;
+  }
+}
 
-  RowType *row = (RowType *)malloc(sizeof(RowType));
+////////////////////////////////////////////////////
+// Add a new, empty, row to the end of the csv tree.
+// The array of Row pointers (rowLookup) that makes finding the
+// correct row fast is grown here as the rows are parsed, rather than
+// built by walking the row list afterwards. This make a big difference
+// on very large csv files.
+// Returns nullptr if out of memory.
+////////////////////////////////////////////////////
+static RowType *addRow(CsvType *csv) {
+  if (csv->numRows64 == csv->rowCapacity64) {
+    uint64_t t0 = nowNs();
+    uint64_t capacity = csv->rowCapacity64 ? 2 * csv->rowCapacity64 : 1024;
+    RowType **rowLookup = (RowType **)csvRealloc(
+        csv, csv->rowLookup, (size_t)(capacity + 1) * sizeof(RowType *));
+    if (rowLookup == nullptr) {
+      return nullptr;
+    }
+    csv->rowLookup = rowLookup;
+    csv->rowCapacity64 = capacity;
+    csv->rowCapacity = capacity < UINT32_MAX ? (uint32_t)capacity : UINT32_MAX;
+    csv->stats.indexNs += nowNs() - t0;
+  }
+  RowType *row = (RowType *)csvMalloc(csv, sizeof(RowType));
+  if (row == nullptr) {
+    return nullptr;
+  }
   memset((void *)row, 0, sizeof(RowType));
   row->first = nullptr;
-  // Note: when a new csv file is being read,
-  // If the first row is nullptr this resets currLastRow
-  if (csv->firstRow == nullptr) {
+  row->last = nullptr;
+  row->next = nullptr;
+  row->rowId = csv->numRows64;
+  if (csv->numRows64 == 0) {
     csv->firstRow = row;
-    row->next = nullptr;
-    row->prev = nullptr;
-    row->rowId = 0;
-    // currLastRow gets reset
-    currLastRow = row;
   } else {
-    RowType *lastRow = currLastRow;
-    lastRow->next = row;
-    row->next = nullptr;
-    row->prev = lastRow;
-    row->rowId = lastRow->rowId + 1;
-    currLastRow = row;
+    csv->rowLookup[csv->numRows64 - 1]->next = row;
+  }
+  csv->rowLookup[csv->numRows64] = row;
+  csv->numRows64++;
+  if (csv->numRows < UINT32_MAX) {
+    csv->numRows++;
+  }
+  addDictRow(csv);
+  return row;
+}
+
+////////////////////////////////////////////////////
+// Add a cell to the end of a row
+////////////////////////////////////////////////////
+static void addCell(CsvType *csv, RowType *row, const char *cellText,
+                    uint32_t len, uint8_t flags) {
+  CellType *cellPtr = (CellType *)csvMalloc(csv, sizeof(CellType));
+  if (cellPtr == nullptr) {
+    return;
+  }
+  cellPtr->next = nullptr;
+  cellPtr->interned = false;
+  cellPtr->cell.bytes = len;
+  cellPtr->cell.flags = flags;
+  csv->stats.cells++;
+  CsvDict *dict = findDict(csv, row->numCols);
+  uint32_t code = CSV_NO_CODE;
+  if (dict != nullptr) {
+    code = internString(csv, dict, cellText, len);
+    if (code == CSV_NO_CODE) {
+      csvFree(csv, cellPtr);
+      return;
+    }
+    if (row->rowId < dict->nCodes) {
+      dict->codes[row->rowId] = code;
+    }
+  }
+  if (len == 0) {
+    cellPtr->cell.status = emptyCell;
+    cellPtr->cell.bytes = 0;
+    cellPtr->cell.cellContents = nullptr;
+  } else if (dict != nullptr) {
+    cellPtr->cell.status = normalCell;
+    cellPtr->cell.cellContents = dict->strings[code];
+    cellPtr->interned = true;
+  } else {
+    cellPtr->cell.status = normalCell;
+    cellPtr->cell.cellContents = (char *)csvMalloc(csv, len + 1);
+    if (cellPtr->cell.cellContents == NULL) {
+      csvFree(csv, cellPtr);
+      return;
+    }
+    memcpy(cellPtr->cell.cellContents, cellText, len);
+    cellPtr->cell.cellContents[len] = '\0';
+    if (DEBUGME > 1)
+      fprintf(stderr, "cellBuf %u %s\n", len, cellPtr->cell.cellContents);
+  }
+  // Use this Cell as the start of the list
+  // or add the cell to the end of the Cell list
+  if (row->first == nullptr) {
+    row->first = cellPtr;
+  } else {
+    row->last->next = cellPtr;
+  }
+  row->last = cellPtr;
+  row->numCols++;
+}
+
+#if defined(__GNUC__)
+#define ALWAYSINLINE inline __attribute__((always_inline))
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define ALWAYSINLINE inline
+#define PREFETCH(p) ((void)(p))
+#endif
+
+////////////////////////////////////////////////////
+// Split one record into cells.
+// The dialect is passed as separate arguments so that, being always
+// inlined, each caller below gets its own copy of the loop with the
+// dialect's constants folded in. Features a dialect does not use
+// (excel quotes, CR, trimming) then cost nothing per byte.
+////////////////////////////////////////////////////
+static ALWAYSINLINE void parseLine(CsvType *csv, const char *buffer,
+                                   uint32_t bufSize, char sep, uint8_t quote,
+                                   bool smartQuotes, bool crlf, bool trim) {
+  // search for a seperator
+  // This tries to identify some 8 bit double quote excel generates.
+  // There is two, a start and end type. macros -- excelStartDQ and excelEndDQ
+  // This is not part of the csv standard
+  RowType *row = addRow(csv);
+  if (row == nullptr) {
+    return;
   }
 
   uint32_t pos = 0;
-  char cellBuf[LINEMAX];
   bool insideExcelDQ = false;
   bool insideDquote = false;
+  // What has been seen in the current cell, for its flags
+  uint8_t flags = 0;
+  uint32_t quoteCount = 0;
+  bool nonDigit = false;
 
-  size_t bufSize = strlen(buffer);
   for (uint32_t i = 0; (i < bufSize) ; i++) {
     uint8_t thisCh = buffer[i];
-    if (thisCh == altDquote) {
+    if (smartQuotes && thisCh == altDquote && i + 2 < bufSize) {
       uint32_t excelCode = (uint8_t)buffer[i] << 16 |
                            (uint8_t)buffer[i + 1] << 8 | (uint8_t)buffer[i + 2];
       if (excelCode == excelStartDQ) {
         insideExcelDQ = true;
+        flags |= CSV_CELL_SMART_QUOTED;
       }
       if (excelCode == excelEndDQ) {
         insideExcelDQ = false;
       }
     }
-    if (thisCh == dquote) {
+    if (thisCh == quote) {
+      quoteCount++;
       if (insideDquote) {
         insideDquote = false;
       } else {
         insideDquote = true;
       }
     }
-    if ((thisCh == sep || thisCh == '\n' || thisCh == '\r') &&
-        (!insideDquote && !insideExcelDQ)) {
+    bool endOfCell = (thisCh == (uint8_t)sep || thisCh == '\n' ||
+                      (crlf && thisCh == '\r'));
+    if (endOfCell && (!insideDquote && !insideExcelDQ)) {
       uint32_t lastPos = pos;
       pos = i;
       if (pos == 0) {
         // This is a weird case. the first ch is the seperator
+        // It stays in the first cell
+        nonDigit = true;
         continue;
       }
       if (i > 0) {
         uint8_t lastCh = buffer[i - 1];
         // This test detects DOS/WINDOWS cr-lf
         // The previous cell was the last
-        if (lastCh == '\n' || lastCh == '\r') {
+        if (lastCh == '\n' || (crlf && lastCh == '\r')) {
           continue;
         }
       }
       // Extract the string between lastPas and Pos
-      CellType *cellPtr = (CellType *)malloc(sizeof(CellType));
-      cellBuf[0] = 0;
-      cellPtr->cell.bytes = 0;
-      int start = lastPos + 1;
-      int finish = pos;
+      uint32_t start = lastPos + 1;
+      uint32_t finish = pos;
       if (lastPos == 0) {
         start = 0;
       }
-      if (finish < 0 || i == 0) {
-        start = 0;
-        finish = 0;
-      }
-      int bpos = 0;
-      for (int p = start; p < finish; p++) {
-        cellBuf[bpos] = buffer[p];
-        bpos++;
-      }
-      cellBuf[bpos] = 0;
-      cellPtr->next = nullptr;
-      uint32_t len = strlen(cellBuf);
-      cellPtr->cell.bytes = len;
-      if (len == 0) {
-        cellPtr->cell.status = emptyCell;
-        cellPtr->cell.bytes = 0;
-        cellPtr->cell.cellContents = nullptr;
-      } else {
-        cellPtr->cell.status = normalCell;
-        cellPtr->cell.cellContents = (char *)malloc(len + 1);
-        if (cellPtr->cell.cellContents == NULL) {
-            fprintf(stderr, "Out of heap memory == file %s line %d\n", __FILE__, __LINE__);
-            fflush(stderr);
-            exit(1);
+      if (trim) {
+        while (start < finish && (buffer[start] == ' ' || buffer[start] == '\t')) {
+          start++;
         }
-        memcpy(cellPtr->cell.cellContents, cellBuf, len);
-        cellPtr->cell.cellContents[len] = '\0';
-        if (DEBUGME > 1)
-          fprintf(stderr, "cellBuf %u %s\n", len, cellBuf);
-      }
-      // Use this Cell as the start of the list
-      if (row->first == nullptr) {
-        row->first = cellPtr;
-        // or add the cell to the end of the Cell list
-      } else {
-        CellType *currRow = row->first;
-        while (currRow->next != nullptr) {
-          currRow = currRow->next;
+        while (finish > start &&
+               (buffer[finish - 1] == ' ' || buffer[finish - 1] == '\t')) {
+          finish--;
         }
-        currRow->next = cellPtr;
+      }
+      // Only a quoted cell has escaped quotes, the enclosing pair are
+      // not among them. A quote in an unquoted cell is just text.
+      if (finish > start && (uint8_t)buffer[start] == quote) {
+        flags |= CSV_CELL_QUOTED;
+        if (quoteCount > 2) {
+          flags |= CSV_CELL_ESCAPED_QUOTES;
+        }
+      }
+      if (!trim && !nonDigit && finish > start) {
+        flags |= CSV_CELL_DIGITS;
+      }
+      addCell(csv, row, &buffer[start], finish - start, flags);
+      flags = 0;
+      quoteCount = 0;
+      nonDigit = false;
+    } else {
+      nonDigit |= (uint8_t)(thisCh - '0') > 9;
+      if (endOfCell) {
+        flags |= (thisCh == (uint8_t)sep) ? CSV_CELL_SEPARATOR : CSV_CELL_NEWLINE;
       }
     }
   }
-  if ( insideDquote || insideExcelDQ) {
-    fprintf(stderr, "A double quote is missing starting at row %d\n",
-            currLastRow->rowId);
+  // A row cut short by running out of memory is dropped by loadFile()
+  if (row->numCols > csv->numCols && !csv->outOfMemory) {
+    csv->numCols = row->numCols;
+  }
+  // A record still inside quotes here was cut short by scanRecord(),
+  // which has logged the error
+}
+
+// Any dialect
+static void parseLineGeneric(CsvType *csv, const char *buffer,
+                             uint32_t bufSize, const CsvDialect *dialect) {
+  parseLine(csv, buffer, bufSize, dialect->separator, (uint8_t)dialect->quote,
+            dialect->smartQuotes, dialect->crlf, dialect->trim);
+}
+
+// The common case, plain comma separated with LF line ends
+static void parseLineComma(CsvType *csv, const char *buffer,
+                           uint32_t bufSize) {
+  parseLine(csv, buffer, bufSize, ',', dquote, false, false, false);
+}
+
+////////////////////////////////////////////////////
+// Can the records in buffer be parsed by parseLineComma()?
+// Yes if the dialect is comma separated with no trimming, and any
+// excel quote or CR handling it asks for has nothing to act on.
+////////////////////////////////////////////////////
+static bool useCommaKernel(const CsvDialect *dialect, const char *buffer,
+                           uint32_t len) {
+  if (dialect->separator != ',' || (uint8_t)dialect->quote != dquote ||
+      dialect->trim) {
+    return false;
+  }
+  if (dialect->smartQuotes && memchr(buffer, altDquote, len) != nullptr) {
+    return false;
   }
+  if (dialect->crlf && memchr(buffer, '\r', len) != nullptr) {
+    return false;
+  }
+  return true;
 }
 
+// The file is read in blocks of READBLOCK bytes.
+// A record with unbalanced quotes may take up to 7 extra lines
+// (MAXRECORD bytes) before it is parsed anyway.
+#define READBLOCK (1024 * 1024)
+#define MAXRECORD (7 * LINEMAX)
+
 ////////////////////////////////////////////////////
-// An even count (even 0) implies that the start and end of the quoted text
-// is in this buffer. An odd number implies that a string carries over to the
-// next line(s)
+// Find the end of the record starting at buffer[start].
+// A record is one line, unless a quote is still open at the end of
+// the line, in which case the next line is appended to cope with
+// multi line cells.
+//
+// An even count of double quotes (even 0) implies that the start and
+// end of the quoted text is in the record.
+// For the excel quotes -- Thank you Microsoft, you have complicated a
+// very simple idea. A pox on you and your editors and overpriced
+// office tools. -- only the last one seen matters. If it was an
+// excelStartDQ the matching quote is on the next (or later) line.
+//
+// Returns the index just past the record's newline, or 0 if the
+// record is not complete in buffer[start, len). At eof the last line
+// need not end with a newline. *nLines is the number of lines in the
+// record and *forced is set if it was cut short at MAXRECORD.
 ////////////////////////////////////////////////////
-uint32_t countCharacter(char *buffer, uint8_t ch) {
-  uint32_t nCharacters = 0;
-  uint32_t len = strlen(buffer);
-  for (int i = 0; i < (int)len; i++) {
-    if ((uint8_t)buffer[i] == ch) {
-      nCharacters++;
+static uint32_t scanRecord(const char *buffer, uint32_t start, uint32_t len,
+                           bool eof, const CsvDialect *dialect,
+                           uint32_t *nLines, bool *forced) {
+  uint8_t quote = (uint8_t)dialect->quote;
+  bool smartQuotes = dialect->smartQuotes;
+  bool oddDquotes = false;
+  bool openExcelDQ = false;
+  uint32_t i = start;
+  *nLines = 0;
+  *forced = false;
+  while (i < len) {
+    const char *nl = (const char *)memchr(&buffer[i], '\n', len - i);
+    if (nl == nullptr && !eof) {
+      return 0;
+    }
+    uint32_t lineEnd = (nl != nullptr) ? (uint32_t)(nl - buffer) + 1 : len;
+    // Most lines have no quotes at all, memchr finds that out quickly
+    uint32_t lineLen = lineEnd - i;
+    if (memchr(&buffer[i], quote, lineLen) != nullptr ||
+        (smartQuotes && memchr(&buffer[i], altDquote, lineLen) != nullptr)) {
+      for (uint32_t q = i; q < lineEnd; q++) {
+        uint8_t ch = buffer[q];
+        if (ch == quote) {
+          oddDquotes = !oddDquotes;
+        } else if (smartQuotes && ch == altDquote && q + 2 < len) {
+          uint32_t excelCode = (uint8_t)buffer[q] << 16 |
+                               (uint8_t)buffer[q + 1] << 8 |
+                               (uint8_t)buffer[q + 2];
+          if (excelCode == excelStartDQ) {
+            openExcelDQ = true;
+          }
+          if (excelCode == excelEndDQ) {
+            openExcelDQ = false;
+          }
+        }
+      }
+    }
+    (*nLines)++;
+    i = lineEnd;
+    if (!oddDquotes && !openExcelDQ) {
+      return i;
+    }
+    if (i - start > MAXRECORD) {
+      *forced = true;
+      return i;
     }
   }
-  return nCharacters;
+  // eof with an unbalanced quote
+  return 0;
 }
 
 ////////////////////////////////////////////////////
-// Count dquote's
-///////////////////////////////////////////////////
-uint32_t countDquotes(char *buffer) { return countCharacter(buffer, dquote); }
+// Read the csv file, a block at a time.
+// Each block is first scanned for whole records, then the records
+// are parsed into cells. A record that runs past the end of the block
+// is moved to the front of the buffer and completed by the next read.
+////////////////////////////////////////////////////
+typedef struct RecordSpan {
+  uint32_t start;
+  uint32_t end;
+} RecordSpan;
 
-uint32_t countAltDquotes(char *buffer) {
-  // Thank you Microsoft, you have complicated a very simple idea.
-  // A pox on you and your editors and overpriced office tools.
-  //
-  // Rather than count, it returns an even number if no excelStartDQ was found
-  // or it found excelEndDQ last in the line. If excelStartDQ was the last
-  // found, an odd number is returned
-  //
-  // Thus an odd count implies that the matching quote is on the next (or later
-  // ) line.
-  uint32_t nCharacters = 0;
-  uint32_t len = strlen(buffer);
-  for (int i = 0; i < (int)len; i++) {
-    if ((uint8_t)buffer[i] == altDquote) {
-      uint32_t excelCode = (uint8_t)buffer[i] << 16 |
-                           (uint8_t)buffer[i + 1] << 8 | (uint8_t)buffer[i + 2];
-      if (excelCode == excelStartDQ) {
-        nCharacters = 1;
-      }
-      if (excelCode == excelEndDQ) {
-        nCharacters = 2;
-      }
+////////////////////////////////////////////////////
+// Which records loadFile() turns into rows, when not all of them.
+// The others are found by scanRecord() but never split into cells.
+////////////////////////////////////////////////////
+typedef struct RecordFilter {
+  uint64_t record;    // number of the next record read
+  uint64_t first;     // records before this are skipped
+  uint64_t end;       // reading stops at this record
+  uint64_t threshold; // keep a record if sampleHash() is below this
+  uint64_t seed;
+  // If stride is not 0, the file offset of every stride'th record is
+  // added to starts (for csvBuildRowIndex)
+  uint64_t offset;    // of buffer[0] in the file
+  uint64_t endOffset; // no need to read past here, UINT64_MAX for the end
+  uint32_t stride;
+  uint64_t *starts;
+  uint64_t nStarts;
+  uint64_t maxStarts;
+} RecordFilter;
+
+// splitmix64, so a sample depends only on the seed and record number
+static uint64_t sampleHash(uint64_t seed, uint64_t record) {
+  uint64_t z = seed + (record + 1) * 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static bool keepRecord(const RecordFilter *filter, uint64_t record) {
+  return record >= filter->first &&
+         (filter->threshold == UINT64_MAX ||
+          sampleHash(filter->seed, record) < filter->threshold);
+}
+
+// false if out of memory
+static bool addRecordStart(RecordFilter *filter, uint64_t offset) {
+  if (filter->nStarts == filter->maxStarts) {
+    uint64_t maxStarts = filter->maxStarts ? 2 * filter->maxStarts : 1024;
+    uint64_t *starts =
+        (uint64_t *)realloc(filter->starts, maxStarts * sizeof(uint64_t));
+    if (starts == nullptr) {
+      return false;
     }
+    filter->starts = starts;
+    filter->maxStarts = maxStarts;
   }
-  return nCharacters;
+  filter->starts[filter->nStarts++] = offset;
+  return true;
 }
 
+
 ////////////////////////////////////////////////////
-// Create and array of Row pointers to make finding
-// the correct row fast. This make a big difference
-// on very large csv files.
+// Add to the error log, which only keeps the first csv->maxErrors
 ////////////////////////////////////////////////////
-void buildRowIndex(CsvType *csv) {
-  csv->rowLookup = (RowType **)malloc((csv->numRows + 1) * sizeof(RowType *));
-  RowType *rowPtr = csv->firstRow;
-  RowType *nextPtr = nullptr;
-  uint32_t rowIndex = 0;
-  if (rowPtr == nullptr) {
+#define CSV_ERROR_ROOM 4
+
+static void addError(CsvType *csv, CsvErrorKind kind, uint64_t row,
+                     uint64_t byteOffset) {
+  csv->errorCount++;
+  if (csv->nErrors == csv->maxErrors) {
     return;
   }
-  csv->rowLookup[rowIndex] = rowPtr;
-  while (rowPtr->next != nullptr) {
-    nextPtr = rowPtr->next;
-    rowPtr = nextPtr;
-    rowIndex++;
-    csv->rowLookup[rowIndex] = rowPtr;
+  // The log grows as needed. newCsv() made room for the first
+  // CSV_ERROR_ROOM, so running out of memory can always be logged
+  // in a load with few other errors.
+  uint32_t n = csv->nErrors;
+  if (n >= CSV_ERROR_ROOM && (n & (n - 1)) == 0) {
+    uint32_t room = 2 * n;
+    CsvError *errors =
+        (CsvError *)csvRealloc(csv, csv->errors, room * sizeof(CsvError));
+    if (errors == nullptr) {
+      // Still counted in errorCount
+      return;
+    }
+    csv->errors = errors;
+  }
+  CsvError *error = &csv->errors[csv->nErrors++];
+  error->row = row;
+  error->byteOffset = byteOffset;
+  error->kind = kind;
+  if (DEBUGME > 0) {
+    fprintf(stderr, "Error %d at row %llu, byte %llu\n", (int)kind,
+            (unsigned long long)row, (unsigned long long)byteOffset);
   }
 }
 
-#define SAFELINEMAX (7 * LINEMAX / 8)
+// The offset just past the first line of buffer[start, len)
+static uint32_t firstLineEnd(const char *buffer, uint32_t start, uint32_t len) {
+  const char *nl = (const char *)memchr(&buffer[start], '\n', len - start);
+  return (nl != nullptr) ? (uint32_t)(nl - buffer) + 1 : len;
+}
+
 ////////////////////////////////////////////////////
-// Read the csv file
+// Reading the file as UTF-8.
+// A byte order mark at the start is dropped. UTF-16 is transcoded a
+// block at a time, keeping any code units that did not fit (or a
+// surrogate pair cut by the block) for the next read.
 ////////////////////////////////////////////////////
-CsvType *readCsv(char *filename, char sep) {
-  FILE *fp = nullptr;
-  CsvType *csv = (CsvType *)malloc(sizeof(CsvType));
-  memset((void *)csv, 0, sizeof(struct CsvType));
-  fp = fopen(filename, "r");
-  if (fp != nullptr) {
-    uint32_t lines = 0;
-    char buffer[LINEMAX * 8]; // This allows 7 lines to be appended
-    memset((void *)buffer, 0, sizeof(buffer));
-    uint32_t startIdx = 0;
-    while (fgets(&buffer[startIdx], LINEMAX, fp) != nullptr) {
-      if (startIdx > 0) {
-        fprintf(stderr, "startIdx %d line %d\n", startIdx, lines);
-      }
-      if (((lines % 1000) == 0) && (DEBUGME > 0)) {
-        fprintf(stderr, "line %d\n", lines);
-      }
-      uint32_t nDquotes = countDquotes(buffer);
-      uint32_t nAltDquotes = countAltDquotes(buffer);
-      // if number of double quotes is odd, append next line to string
-      if ((nDquotes % 2 == 1) || (nAltDquotes % 2 == 1)) {
-        // Basically append the next line to this one to cope with multi line
-        // cells
-        startIdx = strlen(buffer);
-        continue;
-      } else {
-        parseLine(csv, buffer, sep);
-        startIdx = 0;
-      }
-      // Just in case. Dont let the buffer grow beyond 7*LINEMAX/8
-      if (startIdx > SAFELINEMAX) {
-        fprintf(stderr, "Mismatched double quotes in %s. Around line %d\n",
-                filename, lines);
-        parseLine(csv, buffer, sep);
-        startIdx = 0;
-      }
-      if (DEBUGME > 4) {
-        fprintf(stderr, "Parsing %s", buffer);
-      }
-      lines++;
-    }
-    fclose(fp);
-  } else {
-    fprintf(stderr, "Unable to read %s\n", filename);
+typedef struct InputReader {
+  FILE *fp;
+  CsvEncoding encoding;
+  uint32_t bomBytes; // dropped from the start of the file
+  char *raw;         // read from the file but not yet returned
+  uint32_t rawPos;
+  uint32_t rawLen;
+  bool rawEof;
+} InputReader;
+
+static uint32_t encodeUtf8(uint32_t code, char *out) {
+  if (code < 0x80) {
+    out[0] = (char)code;
+    return 1;
   }
-  countRowsAndCols(csv);
-  buildRowIndex(csv);
-  return csv;
+  if (code < 0x800) {
+    out[0] = (char)(0xC0 | (code >> 6));
+    out[1] = (char)(0x80 | (code & 0x3F));
+    return 2;
+  }
+  if (code < 0x10000) {
+    out[0] = (char)(0xE0 | (code >> 12));
+    out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+    out[2] = (char)(0x80 | (code & 0x3F));
+    return 3;
+  }
+  out[0] = (char)(0xF0 | (code >> 18));
+  out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+  out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+  out[3] = (char)(0x80 | (code & 0x3F));
+  return 4;
 }
 
-uint32_t numRows(CsvType *csv) { return csv->numRows; }
-uint32_t numCols(CsvType *csv) { return csv->numCols; }
-
-#ifdef __cplusplus
-CsvClass::CsvClass() { csv = nullptr; }
-//////////////////////////
-CsvClass::~CsvClass() {
-  if (csv != nullptr) {
-    freeMem(csv);
+static uint32_t rawUnit(const InputReader *reader, uint32_t pos) {
+  const uint8_t *raw = (const uint8_t *)reader->raw;
+  if (reader->encoding == csvEncodingUtf16LE) {
+    return raw[pos] | (uint32_t)raw[pos + 1] << 8;
   }
+  return (uint32_t)raw[pos] << 8 | raw[pos + 1];
 }
 
-//////////////////////////
-uint32_t CsvClass::NumRows() {
-  uint32_t count = 0;
-  if (csv != nullptr) {
-    count = csv->numRows;
+static uint32_t transcodeUtf16(CsvType *csv, InputReader *reader, char *out,
+                               uint32_t want) {
+  uint32_t n = 0;
+  for (;;) {
+    uint32_t left = reader->rawLen - reader->rawPos;
+    if (left < 4 && !reader->rawEof) {
+      memmove(reader->raw, &reader->raw[reader->rawPos], left);
+      size_t nRead = fread(&reader->raw[left], 1, READBLOCK - left, reader->fp);
+      csv->stats.bytesRead += nRead;
+      reader->rawPos = 0;
+      reader->rawLen = left + (uint32_t)nRead;
+      reader->rawEof = (nRead == 0);
+      left = reader->rawLen;
+    }
+    if (left < 2) {
+      if (left == 1 && reader->rawEof) {
+        // An odd byte at the end of the file
+        csv->stats.badUtf16Units++;
+        reader->rawPos++;
+      }
+      return n;
+    }
+    uint32_t code = rawUnit(reader, reader->rawPos);
+    uint32_t units = 1;
+    if (code >= 0xD800 && code < 0xDC00 && left >= 4 &&
+        rawUnit(reader, reader->rawPos + 2) >= 0xDC00 &&
+        rawUnit(reader, reader->rawPos + 2) < 0xE000) {
+      code = 0x10000 + ((code - 0xD800) << 10) +
+             (rawUnit(reader, reader->rawPos + 2) - 0xDC00);
+      units = 2;
+    } else if (code >= 0xD800 && code < 0xE000) {
+      code = 0xFFFD; // a surrogate without its other half
+    }
+    char utf8[4];
+    uint32_t bytes = encodeUtf8(code, utf8);
+    if (n + bytes > want) {
+      return n;
+    }
+    if (code == 0xFFFD && units == 1 && rawUnit(reader, reader->rawPos) != 0xFFFD) {
+      csv->stats.badUtf16Units++;
+    }
+    memcpy(&out[n], utf8, bytes);
+    n += bytes;
+    reader->rawPos += 2 * units;
   }
-  return count;
 }
 
-//////////////////////////
-uint32_t CsvClass::NumCols() {
-  uint32_t count = 0;
-  if (csv != nullptr) {
-    count = csv->numCols;
+// Look for a byte order mark at the start of the file
+static void readBom(CsvType *csv, InputReader *reader) {
+  uint8_t bom[3] = {0, 0, 0};
+  size_t nBom = fread(bom, 1, 3, reader->fp);
+  CsvEncoding found = csvEncodingUtf8;
+  uint32_t bomBytes = 0;
+  if (nBom == 3 && bom[0] == 0xEF && bom[1] == 0xBB && bom[2] == 0xBF) {
+    bomBytes = 3;
+  } else if (nBom >= 2 && bom[0] == 0xFF && bom[1] == 0xFE) {
+    found = csvEncodingUtf16LE;
+    bomBytes = 2;
+  } else if (nBom >= 2 && bom[0] == 0xFE && bom[1] == 0xFF) {
+    found = csvEncodingUtf16BE;
+    bomBytes = 2;
   }
-  return count;
+  if (reader->encoding == csvEncodingAuto) {
+    reader->encoding = found;
+  }
+  // A forced encoding only drops its own byte order mark. Any other is
+  // kept as text, so nothing in the file silently disappears.
+  reader->bomBytes = (reader->encoding == found) ? bomBytes : 0;
+  csv->stats.bytesRead += nBom;
+  // What followed the byte order mark (or all of it, if there was none)
+  // is read again from raw
+  bool utf8 = (reader->encoding == csvEncodingUtf8);
+  reader->raw = (char *)csvMalloc(csv, utf8 ? sizeof(bom) : READBLOCK);
+  if (reader->raw == nullptr) {
+    return;
+  }
+  reader->rawLen = (uint32_t)nBom - reader->bomBytes;
+  memcpy(reader->raw, &bom[reader->bomBytes], reader->rawLen);
 }
-//////////////////////////
-bool CsvClass::ReadCsv(char *filename, char sep) {
-  bool result = false;
-  csv = readCsv(filename, sep);
-  if (csv != nullptr) {
-    result = true;
+
+// Read up to want bytes of UTF-8 into out, 0 at the end of the file
+static uint32_t readInput(CsvType *csv, InputReader *reader, char *out,
+                          uint32_t want) {
+  if (reader->encoding == csvEncodingUtf16LE ||
+      reader->encoding == csvEncodingUtf16BE) {
+    return transcodeUtf16(csv, reader, out, want);
   }
-  return (result);
+  uint32_t n = 0;
+  while (reader->rawPos < reader->rawLen && n < want) {
+    out[n++] = reader->raw[reader->rawPos++];
+  }
+  size_t nRead = fread(&out[n], 1, want - n, reader->fp);
+  csv->stats.bytesRead += nRead;
+  return n + (uint32_t)nRead;
 }
 
+////////////////////////////////////////////////////
+// UTF-8 validation.
+// Almost all csv text is ASCII, which is checked 16 (or 8) bytes at a
+// time. Only cells in records that have other bytes go through the
+// byte at a time check of Unicode's well formed sequences.
+////////////////////////////////////////////////////
+static bool isAscii(const char *text, uint32_t len) {
+  uint32_t i = 0;
+#if defined(__SSE2__)
+  __m128i high = _mm_setzero_si128();
+  for (; i + 16 <= len; i += 16) {
+    high = _mm_or_si128(high, _mm_loadu_si128((const __m128i *)&text[i]));
+  }
+  if (_mm_movemask_epi8(high) != 0) {
+    return false;
+  }
+#endif
+  uint64_t high8 = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, &text[i], sizeof(word));
+    high8 |= word;
+  }
+  for (; i < len; i++) {
+    high8 |= (uint8_t)text[i];
+  }
+  return (high8 & 0x8080808080808080ULL) == 0;
+}
+
+static bool validUtf8(const char *text, uint32_t len) {
+  const uint8_t *bytes = (const uint8_t *)text;
+  uint32_t i = 0;
+  while (i < len) {
+    uint8_t b = bytes[i];
+    if (b < 0x80) {
+      i++;
+      continue;
+    }
+    uint32_t n;
+    uint8_t lo = 0x80;
+    uint8_t hi = 0xBF; // allowed range of the second byte
+    if (b >= 0xC2 && b <= 0xDF) {
+      n = 1;
+    } else if (b >= 0xE0 && b <= 0xEF) {
+      n = 2;
+      lo = (b == 0xE0) ? 0xA0 : 0x80; // no overlong forms
+      hi = (b == 0xED) ? 0x9F : 0xBF; // no surrogates
+    } else if (b >= 0xF0 && b <= 0xF4) {
+      n = 3;
+      lo = (b == 0xF0) ? 0x90 : 0x80;
+      hi = (b == 0xF4) ? 0x8F : 0xBF; // nothing above U+10FFFF
+    } else {
+      return false;
+    }
+    if (i + n >= len) {
+      return false;
+    }
+    if (bytes[i + 1] < lo || bytes[i + 1] > hi) {
+      return false;
+    }
+    for (uint32_t k = 2; k <= n; k++) {
+      if ((bytes[i + k] & 0xC0) != 0x80) {
+        return false;
+      }
+    }
+    i += n + 1;
+  }
+  return true;
+}
+
+static void validateRow(CsvType *csv, RowType *row) {
+  for (CellType *cellPtr = row->first; cellPtr != nullptr;
+       cellPtr = cellPtr->next) {
+    if (cellPtr->cell.cellContents != nullptr &&
+        !validUtf8(cellPtr->cell.cellContents, cellPtr->cell.bytes)) {
+      cellPtr->cell.flags |= CSV_CELL_INVALID_UTF8;
+      csv->stats.invalidUtf8Cells++;
+    }
+  }
+}
+
+// Take back the last row, which memory ran out part way through
+static void dropLastRow(CsvType *csv) {
+  uint64_t last = csv->numRows64 - 1;
+  for (uint32_t d = 0; d < csv->nDicts; d++) {
+    if (csv->dicts[d].nCodes > last) {
+      csv->dicts[d].nCodes = (uint32_t)last;
+    }
+  }
+  freeRow(csv, csv->rowLookup[last]);
+  csv->rowLookup[last] = nullptr;
+  csv->numRows64 = last;
+  csv->numRows = last < UINT32_MAX ? (uint32_t)last : UINT32_MAX;
+  if (last == 0) {
+    csv->firstRow = nullptr;
+  } else {
+    csv->rowLookup[last - 1]->next = nullptr;
+  }
+}
+
+// Returns the encoding the file was read as. If memory runs out the
+// load stops there, with a csvErrorOutOfMemory error, keeping the rows
+// before it.
+static CsvEncoding loadFile(CsvType *csv, FILE *fp, const CsvOptions *opts,
+                            RecordFilter *filter) {
+  const CsvDialect *dialect = &opts->dialect;
+  CsvStats *stats = &csv->stats;
+  uint32_t bufSize = READBLOCK;
+  if (opts->blockBytes != 0) {
+    bufSize = (opts->blockBytes < 8) ? 8 : opts->blockBytes;
+  }
+  char *buffer = (char *)csvMalloc(csv, bufSize);
+  uint32_t maxSpans = 1024;
+  RecordSpan *spans = (RecordSpan *)csvMalloc(csv, maxSpans * sizeof(RecordSpan));
+  InputReader reader;
+  memset((void *)&reader, 0, sizeof(reader));
+  reader.fp = fp;
+  reader.encoding = opts->encoding;
+  reader.raw = nullptr;
+  // A range read from an index starts part way through a UTF-8 file
+  if (filter == nullptr || filter->offset == 0) {
+    readBom(csv, &reader);
+    if (filter != nullptr) {
+      filter->offset = reader.bomBytes;
+    }
+  } else if (reader.encoding == csvEncodingAuto) {
+    reader.encoding = csvEncodingUtf8;
+  }
+  // Where buffer[0] is in the file (in the UTF-8 text for UTF-16)
+  uint64_t bufferOffset = (filter != nullptr) ? filter->offset : reader.bomBytes;
+  uint32_t len = 0;
+  bool eof = false;
+  // the filter wants no more records, csvStrict, or out of memory
+  bool done = csv->outOfMemory;
+  if (done) {
+    addError(csv, csvErrorOutOfMemory, csv->numRows64, bufferOffset);
+  }
+  // Where memory for the spans or record starts ran out. The records
+  // before it are still parsed.
+  uint64_t stopOffset = UINT64_MAX;
+  while (!eof && !done) {
+    // Leave room for at least one transcoded character
+    if (bufSize - len < 4) {
+      // One record is bigger than the buffer. Records are limited
+      // to 4GB, the lengths in the buffer are 32 bit
+      char *bigger = nullptr;
+      if (bufSize <= UINT32_MAX / 2) {
+        bigger = (char *)csvRealloc(csv, buffer, 2 * (size_t)bufSize);
+      }
+      if (bigger == nullptr) {
+        csv->outOfMemory = true;
+        addError(csv, csvErrorOutOfMemory, csv->numRows64, bufferOffset);
+        done = true;
+        break;
+      }
+      buffer = bigger;
+      bufSize *= 2;
+    }
+    size_t want = bufSize - len;
+    if (filter != nullptr && filter->endOffset - bufferOffset - len < want) {
+      want = filter->endOffset - bufferOffset - len;
+    }
+    uint64_t t0 = nowNs();
+    uint32_t nRead = readInput(csv, &reader, &buffer[len], (uint32_t)want);
+    uint64_t t1 = nowNs();
+    stats->ioNs += t1 - t0;
+    len += nRead;
+    eof = (nRead == 0);
+
+    uint32_t nSpans = 0;
+    uint32_t pos = 0;
+    for (;;) {
+      uint32_t nLines = 0;
+      bool forced = false;
+      uint32_t end =
+          scanRecord(buffer, pos, len, eof, dialect, &nLines, &forced);
+      if (end == 0 && eof && pos < len &&
+          opts->errorPolicy == csvSkipRecord) {
+        // The file ends inside quotes. Drop the line the quote opened
+        // on and try again from the next one.
+        addError(csv, csvErrorUnterminatedQuote, csv->numRows64 + nSpans,
+                 bufferOffset + pos);
+        stats->malformedQuotes++;
+        pos = firstLineEnd(buffer, pos, len);
+        continue;
+      }
+      if (end == 0) {
+        break;
+      }
+      if (filter != nullptr) {
+        uint64_t record = filter->record++;
+        if (record >= filter->end) {
+          done = true;
+          break;
+        }
+        if (filter->stride != 0 && record % filter->stride == 0 &&
+            !addRecordStart(filter, bufferOffset + pos)) {
+          stopOffset = bufferOffset + pos;
+          done = true;
+          break;
+        }
+        if (!keepRecord(filter, record)) {
+          pos = end;
+          continue;
+        }
+      }
+      if (nLines > 1) {
+        stats->multiLineRecords++;
+        if (DEBUGME > 1) {
+          fprintf(stderr, "%u lines in record %llu\n", nLines,
+                  (unsigned long long)csv->numRows64);
+        }
+      }
+      if (forced) {
+        stats->malformedQuotes++;
+        addError(csv, csvErrorRunawayQuote, csv->numRows64 + nSpans,
+                 bufferOffset + pos);
+        if (opts->errorPolicy == csvStrict) {
+          done = true;
+          break;
+        }
+        if (opts->errorPolicy == csvSkipRecord) {
+          // Resync at the end of the line the quote opened on
+          pos = firstLineEnd(buffer, pos, len);
+          continue;
+        }
+      }
+      if (nSpans == maxSpans) {
+        RecordSpan *more = (RecordSpan *)csvRealloc(
+            csv, spans, 2 * maxSpans * sizeof(RecordSpan));
+        if (more == nullptr) {
+          csv->outOfMemory = false;
+          stopOffset = bufferOffset + pos;
+          done = true;
+          break;
+        }
+        spans = more;
+        maxSpans *= 2;
+      }
+      spans[nSpans].start = pos;
+      spans[nSpans].end = end;
+      nSpans++;
+      pos = end;
+    }
+    uint64_t t2 = nowNs();
+    stats->scanNs += t2 - t1;
+
+    bool commaKernel =
+        !opts->genericParser && useCommaKernel(dialect, buffer, pos);
+    bool checkUtf8 = opts->validateUtf8 && !isAscii(buffer, pos);
+    for (uint32_t r = 0; r < nSpans; r++) {
+      const char *record = &buffer[spans[r].start];
+      uint32_t recordLen = spans[r].end - spans[r].start;
+      // Cells split at ASCII bytes, so a valid record has valid cells
+      bool badUtf8 = checkUtf8 && !isAscii(record, recordLen) &&
+                     !validUtf8(record, recordLen);
+      if (badUtf8) {
+        addError(csv, csvErrorInvalidUtf8, csv->numRows64,
+                 bufferOffset + spans[r].start);
+        if (opts->errorPolicy == csvStrict) {
+          done = true;
+          break;
+        }
+        if (opts->errorPolicy == csvSkipRecord) {
+          continue;
+        }
+      }
+      uint64_t rowsBefore = csv->numRows64;
+      if (commaKernel) {
+        parseLineComma(csv, record, recordLen);
+      } else {
+        parseLineGeneric(csv, record, recordLen, dialect);
+      }
+      if (csv->outOfMemory) {
+        if (csv->numRows64 > rowsBefore) {
+          dropLastRow(csv);
+        }
+        addError(csv, csvErrorOutOfMemory, csv->numRows64,
+                 bufferOffset + spans[r].start);
+        done = true;
+        break;
+      }
+      if (badUtf8) {
+        validateRow(csv, csv->rowLookup[csv->numRows64 - 1]);
+      }
+      if (((stats->rows % 1000) == 0) && (DEBUGME > 0)) {
+        fprintf(stderr, "line %llu\n", (unsigned long long)stats->rows);
+      }
+      stats->rows++;
+    }
+    stats->materializeNs += nowNs() - t2;
+    if (stopOffset != UINT64_MAX && !csv->outOfMemory) {
+      csv->outOfMemory = true;
+      addError(csv, csvErrorOutOfMemory, csv->numRows64, stopOffset);
+    }
+
+    // Keep the incomplete record for the next read
+    memmove(buffer, &buffer[pos], len - pos);
+    len -= pos;
+    bufferOffset += pos;
+  }
+  if (len > 0 && !done) {
+    // The file ended inside a quoted cell, that record is dropped
+    stats->malformedQuotes++;
+    addError(csv, csvErrorUnterminatedQuote, csv->numRows64, bufferOffset);
+  }
+  csvFree(csv, reader.raw);
+  csvFree(csv, spans);
+  csvFree(csv, buffer);
+  return reader.encoding;
+}
+
+////////////////////////////////////////////////////
+// Read the csv file
+////////////////////////////////////////////////////
+void csvDefaultOptions(CsvOptions *opts) {
+  memset((void *)opts, 0, sizeof(CsvOptions));
+  opts->dialect.separator = ',';
+  opts->dialect.quote = '"';
+  opts->dialect.smartQuotes = true;
+  opts->dialect.crlf = true;
+  opts->dialect.trim = false;
+  opts->dictCols = nullptr;
+  opts->nDictCols = 0;
+  opts->encoding = csvEncodingAuto;
+  opts->validateUtf8 = false;
+  opts->errorPolicy = csvBestEffort;
+  opts->maxErrors = CSV_DEFAULT_MAX_ERRORS;
+  opts->blockBytes = 0;
+  opts->genericParser = false;
+}
+
+CsvType *readCsv(const char *filename, char sep) {
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.dialect.separator = sep;
+  return readCsvOptions(filename, &opts);
+}
+
+// An empty csv, ready for rows to be added. nullptr if out of memory.
+static CsvType *newCsv(const CsvOptions *opts) {
+  const CsvAllocator *allocator = &opts->allocator;
+  if (allocator->alloc == nullptr || allocator->realloc == nullptr ||
+      allocator->free == nullptr) {
+    allocator = &defaultAllocator;
+  }
+  CsvType *csv = (CsvType *)allocator->alloc(allocator->ctx, sizeof(CsvType));
+  if (csv == nullptr) {
+    return nullptr;
+  }
+  memset((void *)csv, 0, sizeof(struct CsvType));
+  csv->allocator = *allocator;
+  csv->stats.allocCount = 1;
+  csv->stats.allocBytes = sizeof(CsvType);
+  csv->maxErrors = opts->maxErrors ? opts->maxErrors : CSV_DEFAULT_MAX_ERRORS;
+  if (opts->nDictCols > 0) {
+    csv->dicts =
+        (CsvDict *)csvCalloc(csv, opts->nDictCols, sizeof(CsvDict));
+    for (uint32_t d = 0; csv->dicts != nullptr && d < opts->nDictCols; d++) {
+      if (findDict(csv, opts->dictCols[d]) == nullptr) {
+        csv->dicts[csv->nDicts].col = opts->dictCols[d];
+        growDictSlots(csv, &csv->dicts[csv->nDicts]);
+        csv->nDicts++;
+      }
+    }
+  }
+  // rowLookup always exists, even for an empty file
+  csv->rowLookup = (RowType **)csvMalloc(csv, sizeof(RowType *));
+  csv->errors = (CsvError *)csvMalloc(csv, CSV_ERROR_ROOM * sizeof(CsvError));
+  if (csv->outOfMemory) {
+    freeMem(csv);
+    return nullptr;
+  }
+  return csv;
+}
+
+static CsvType *loadCsv(const char *filename, const CsvOptions *opts,
+                        bool *opened) {
+  CsvType *csv = newCsv(opts);
+  *opened = false;
+  if (csv == nullptr) {
+    return nullptr;
+  }
+  FILE *fp = fopen(filename, "r");
+  *opened = (fp != nullptr);
+  if (fp != nullptr) {
+    loadFile(csv, fp, opts, nullptr);
+    fclose(fp);
+  } else {
+    addError(csv, csvErrorUnreadable, 0, 0);
+  }
+  return csv;
+}
+
+CsvType *readCsvOptions(const char *filename, const CsvOptions *opts) {
+  bool opened = false;
+  return loadCsv(filename, opts, &opened);
+}
+
+////////////////////////////////////////////////////
+// Row index sidecar files.
+// filename.csvidx has the file offset of every ROWINDEXSTRIDE'th
+// record, so a range or sample can start reading near the rows it
+// wants. It is ignored unless the csv's size and modification time,
+// and the quoting that decided where records end, still match.
+////////////////////////////////////////////////////
+#define ROWINDEXMAGIC "CSVRIDX1"
+// Set it from the build to try the index on small files
+#ifndef ROWINDEXSTRIDE
+#define ROWINDEXSTRIDE 1024
+#endif
+
+typedef struct RowIndexHeader {
+  char magic[8];
+  uint32_t stride;
+  uint8_t quote;
+  uint8_t smartQuotes;
+  uint16_t unused;
+  uint64_t fileBytes;
+  int64_t mtimeSec;
+  int64_t mtimeNsec;
+  uint64_t nRecords;
+  uint64_t nStarts;
+} RowIndexHeader;
+
+typedef struct RowIndex {
+  uint32_t stride;
+  uint64_t nRecords;
+  uint64_t nStarts;
+  uint64_t *starts;
+} RowIndex;
+
+static char *rowIndexName(const char *filename) {
+  size_t len = strlen(filename);
+  char *name = (char *)malloc(len + sizeof(".csvidx"));
+  if (name != nullptr) {
+    memcpy(name, filename, len);
+    memcpy(name + len, ".csvidx", sizeof(".csvidx"));
+  }
+  return name;
+}
+
+static void rowIndexHeader(RowIndexHeader *header, const struct stat *st,
+                           const CsvDialect *dialect) {
+  memset((void *)header, 0, sizeof(RowIndexHeader));
+  memcpy(header->magic, ROWINDEXMAGIC, sizeof(header->magic));
+  header->stride = ROWINDEXSTRIDE;
+  header->quote = (uint8_t)dialect->quote;
+  header->smartQuotes = dialect->smartQuotes;
+  header->fileBytes = (uint64_t)st->st_size;
+  header->mtimeSec = (int64_t)st->st_mtim.tv_sec;
+  header->mtimeNsec = (int64_t)st->st_mtim.tv_nsec;
+}
+
+static void clearFilter(RecordFilter *filter) {
+  memset((void *)filter, 0, sizeof(RecordFilter));
+  filter->end = UINT64_MAX;
+  filter->endOffset = UINT64_MAX;
+  filter->threshold = UINT64_MAX;
+  filter->starts = nullptr;
+}
+
+// Find the record starts of an open file, without keeping any rows
+static bool scanRowIndex(FILE *fp, const CsvOptions *opts, RowIndex *index) {
+  // Only the record boundaries are wanted, not the rows
+  CsvOptions scanOpts = *opts;
+  scanOpts.nDictCols = 0;
+  CsvType *csv = newCsv(&scanOpts);
+  if (csv == nullptr) {
+    return false;
+  }
+  RecordFilter filter;
+  clearFilter(&filter);
+  filter.first = UINT64_MAX;
+  filter.stride = ROWINDEXSTRIDE;
+  CsvEncoding encoding = loadFile(csv, fp, &scanOpts, &filter);
+  bool complete = !csv->outOfMemory;
+  freeMem(csv);
+  if (encoding != csvEncodingUtf8 || !complete) {
+    // Offsets in the transcoded text are no use for seeking
+    free(filter.starts);
+    return false;
+  }
+  index->stride = ROWINDEXSTRIDE;
+  index->nRecords = filter.record;
+  index->nStarts = filter.nStarts;
+  index->starts = filter.starts;
+  return true;
+}
+
+bool csvBuildRowIndex(const char *filename, const CsvOptions *opts) {
+  CsvOptions defaults;
+  if (opts == nullptr) {
+    csvDefaultOptions(&defaults);
+    opts = &defaults;
+  }
+  FILE *fp = fopen(filename, "r");
+  struct stat st;
+  if (fp == nullptr || fstat(fileno(fp), &st) != 0) {
+    if (fp != nullptr) {
+      fclose(fp);
+    }
+    return false;
+  }
+  RowIndex index;
+  bool scanned = scanRowIndex(fp, opts, &index);
+  fclose(fp);
+  if (!scanned) {
+    return false;
+  }
+
+  RowIndexHeader header;
+  rowIndexHeader(&header, &st, &opts->dialect);
+  header.nRecords = index.nRecords;
+  header.nStarts = index.nStarts;
+  char *name = rowIndexName(filename);
+  fp = (name != nullptr) ? fopen(name, "wb") : nullptr;
+  bool ok = (fp != nullptr && fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             (index.nStarts == 0 ||
+              fwrite(index.starts, sizeof(uint64_t), index.nStarts, fp) ==
+                  index.nStarts));
+  if (fp != nullptr) {
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {
+      remove(name);
+    }
+  }
+  free(name);
+  free(index.starts);
+  return ok;
+}
+
+// false if there is no up to date index for filename
+static bool loadRowIndex(const char *filename, const CsvDialect *dialect,
+                         RowIndex *index) {
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    return false;
+  }
+  RowIndexHeader expected;
+  RowIndexHeader header;
+  rowIndexHeader(&expected, &st, dialect);
+  char *name = rowIndexName(filename);
+  FILE *fp = (name != nullptr) ? fopen(name, "rb") : nullptr;
+  free(name);
+  if (fp == nullptr) {
+    return false;
+  }
+  bool ok = (fread(&header, sizeof(header), 1, fp) == 1 &&
+             memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0 &&
+             header.stride > 0 && header.quote == expected.quote &&
+             header.smartQuotes == expected.smartQuotes &&
+             header.fileBytes == expected.fileBytes &&
+             header.mtimeSec == expected.mtimeSec &&
+             header.mtimeNsec == expected.mtimeNsec &&
+             header.nStarts <= header.fileBytes);
+  index->starts = nullptr;
+  if (ok && header.nStarts > 0) {
+    index->starts = (uint64_t *)malloc(header.nStarts * sizeof(uint64_t));
+    ok = (index->starts != nullptr &&
+          fread(index->starts, sizeof(uint64_t), header.nStarts, fp) ==
+              header.nStarts);
+  }
+  fclose(fp);
+  if (!ok) {
+    free(index->starts);
+    return false;
+  }
+  index->stride = header.stride;
+  index->nRecords = header.nRecords;
+  index->nStarts = header.nStarts;
+  return true;
+}
+
+// Set up filter to read records [first, end), starting from the
+// index's nearest record start
+static void seekRecords(FILE *fp, const RowIndex *index, uint64_t first,
+                        uint64_t end, RecordFilter *filter) {
+  uint64_t s = first / index->stride;
+  if (s >= index->nStarts) {
+    s = index->nStarts - 1;
+  }
+  uint64_t e = (end + index->stride - 1) / index->stride;
+  filter->endOffset = UINT64_MAX;
+  if (end != UINT64_MAX && e < index->nStarts) {
+    filter->endOffset = index->starts[e];
+  }
+  if (fseeko(fp, (off_t)index->starts[s], SEEK_SET) == 0) {
+    filter->record = s * index->stride;
+    filter->offset = index->starts[s];
+  } else {
+    rewind(fp);
+    filter->record = 0;
+    filter->offset = 0;
+    filter->endOffset = UINT64_MAX;
+  }
+}
+
+////////////////////////////////////////////////////
+// Read some of the records of a csv file
+////////////////////////////////////////////////////
+CsvType *readCsvRangeOptions(const char *filename, uint64_t firstRow,
+                             uint32_t count, const CsvOptions *opts) {
+  CsvType *csv = newCsv(opts);
+  if (csv == nullptr) {
+    return nullptr;
+  }
+  FILE *fp = fopen(filename, "r");
+  if (fp == nullptr) {
+    addError(csv, csvErrorUnreadable, 0, 0);
+    return csv;
+  }
+  RecordFilter filter;
+  clearFilter(&filter);
+  filter.first = firstRow;
+  filter.end = (firstRow > UINT64_MAX - count) ? UINT64_MAX : firstRow + count;
+  RowIndex index;
+  if (loadRowIndex(filename, &opts->dialect, &index)) {
+    if (index.nStarts > 0) {
+      seekRecords(fp, &index, filter.first, filter.end, &filter);
+    }
+    free(index.starts);
+  }
+  if (count > 0) {
+    loadFile(csv, fp, opts, &filter);
+  }
+  fclose(fp);
+  return csv;
+}
+
+CsvType *readCsvRange(const char *filename, uint64_t firstRow,
+                      uint32_t count) {
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  return readCsvRangeOptions(filename, firstRow, count, &opts);
+}
+
+////////////////////////////////////////////////////
+// Each record is kept with probability fraction, decided by a hash of
+// the seed and its record number. With an index, groups of records
+// with nothing to keep are not read at all.
+////////////////////////////////////////////////////
+CsvType *readCsvSampleOptions(const char *filename, double fraction,
+                              uint64_t seed, const CsvOptions *opts) {
+  CsvType *csv = newCsv(opts);
+  if (csv == nullptr) {
+    return nullptr;
+  }
+  FILE *fp = fopen(filename, "r");
+  if (fp == nullptr) {
+    addError(csv, csvErrorUnreadable, 0, 0);
+    return csv;
+  }
+  RecordFilter filter;
+  clearFilter(&filter);
+  filter.seed = seed;
+  if (!(fraction > 0.0)) {
+    fclose(fp);
+    return csv;
+  }
+  if (fraction < 1.0) {
+    filter.threshold = (uint64_t)(fraction * 18446744073709551616.0);
+  }
+  RowIndex index;
+  if (!loadRowIndex(filename, &opts->dialect, &index) || index.nStarts == 0) {
+    loadFile(csv, fp, opts, &filter);
+    fclose(fp);
+    return csv;
+  }
+  uint64_t g = 0;
+  while (g < index.nStarts) {
+    // Find the next run of groups that have a record to keep
+    uint64_t runStart = UINT64_MAX;
+    for (; g < index.nStarts; g++) {
+      uint64_t first = g * index.stride;
+      uint64_t end = first + index.stride;
+      if (end > index.nRecords) {
+        end = index.nRecords;
+      }
+      bool wanted = false;
+      for (uint64_t r = first; r < end && !wanted; r++) {
+        wanted = keepRecord(&filter, r);
+      }
+      if (wanted && runStart == UINT64_MAX) {
+        runStart = g;
+      } else if (!wanted && runStart != UINT64_MAX) {
+        break;
+      }
+    }
+    if (runStart == UINT64_MAX) {
+      break;
+    }
+    uint64_t runEnd = (g < index.nStarts) ? g * index.stride : UINT64_MAX;
+    seekRecords(fp, &index, runStart * index.stride, runEnd, &filter);
+    filter.first = runStart * index.stride;
+    filter.end = runEnd;
+    loadFile(csv, fp, opts, &filter);
+  }
+  free(index.starts);
+  fclose(fp);
+  return csv;
+}
+
+CsvType *readCsvSample(const char *filename, double fraction, uint64_t seed) {
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  return readCsvSampleOptions(filename, fraction, seed, &opts);
+}
+
+////////////////////////////////////////////////////
+// The flags say which work is needed, so plain cells are one copy
+////////////////////////////////////////////////////
+uint32_t csvUnescapeCell(const CsvCellType *cell, char *out, uint32_t outSize) {
+  const char *text = cell->cellContents;
+  uint32_t len = (text != nullptr) ? cell->bytes : 0;
+  char quote = 0;
+  if ((cell->flags & CSV_CELL_QUOTED) && len > 0) {
+    // The quote is whatever the dialect used, the first byte says which
+    quote = text[0];
+    text++;
+    len--;
+    if (len > 0 && text[len - 1] == quote) {
+      len--;
+    }
+  }
+  uint32_t decoded = len;
+  if (!(cell->flags & CSV_CELL_ESCAPED_QUOTES) || quote == 0) {
+    uint32_t n = (outSize > 0 && len >= outSize) ? outSize - 1 : len;
+    if (n > 0) {
+      memcpy(out, text, n);
+    }
+    if (outSize > 0) {
+      out[n] = '\0';
+    }
+    return decoded;
+  }
+  decoded = 0;
+  for (uint32_t i = 0; i < len; i++) {
+    if (text[i] == quote && i + 1 < len && text[i + 1] == quote) {
+      i++;
+    }
+    if (decoded + 1 < outSize) {
+      out[decoded] = text[i];
+    }
+    decoded++;
+  }
+  if (outSize > 0) {
+    out[decoded < outSize ? decoded : outSize - 1] = '\0';
+  }
+  return decoded;
+}
+
+uint32_t numRows(CsvType *csv) { return csv->numRows; }
+uint32_t numCols(CsvType *csv) { return csv->numCols; }
+uint64_t numRows64(CsvType *csv) { return csv->numRows64; }
+
+// Sorting, hash indexes and dictionary codes keep 32 bit row ids
+static bool rowIdsFit(const CsvType *csv) {
+  return csv->numRows64 < UINT32_MAX;
+}
+
+CsvRowCursor csvRowCursor(CsvType *csv, uint32_t row) {
+  return csvRowCursor64(csv, row);
+}
+
+CsvRowCursor csvRowCursor64(CsvType *csv, uint64_t row) {
+  CsvRowCursor cursor;
+  cursor.csv = csv;
+  cursor.cell = nullptr;
+  cursor.remaining = 0;
+  if (csv != nullptr && row < csv->numRows64) {
+    if (csv->snapshot != nullptr) {
+      const uint64_t *rows = snapRows(csv);
+      cursor.remaining = (uint32_t)(rows[row + 1] - rows[row]);
+      cursor.cell = cursor.remaining ? &snapCells(csv)[rows[row]] : nullptr;
+    } else {
+      cursor.cell = csv->rowLookup[row]->first;
+    }
+  }
+  return cursor;
+}
+
+bool csvRowNext(CsvRowCursor *cursor, CsvCellView *view) {
+  if (cursor->cell == nullptr) {
+    return false;
+  }
+  if (cursor->csv->snapshot != nullptr) {
+    const SnapCell *snapCell = (const SnapCell *)cursor->cell;
+    view->contents = snapText(cursor->csv, snapCell);
+    view->bytes = view->contents ? snapCell->bytes : 0;
+    view->flags = view->contents ? (uint8_t)snapCell->flags : 0;
+    cursor->remaining--;
+    cursor->cell = cursor->remaining ? snapCell + 1 : nullptr;
+    return true;
+  }
+  const CellType *cellPtr = (const CellType *)cursor->cell;
+  view->contents = cellPtr->cell.cellContents;
+  view->bytes = cellPtr->cell.bytes;
+  view->flags = cellPtr->cell.flags;
+  cursor->cell = cellPtr->next;
+  return true;
+}
+
+////////////////////////////////////////////////////
+// The cells of a block of rows in storage order, without a call per
+// cell. Walking the tree is a chain of pointer loads, so rows are
+// prefetched ahead: the RowType of row r + ROWPREFETCH, then the
+// first cell of row r + ROWPREFETCH / 2, whose RowType should be in
+// cache by then.
+////////////////////////////////////////////////////
+#define ROWPREFETCH 8
+
+uint32_t csvGetRowBatch(CsvType *csv, uint64_t firstRow, uint32_t nRows,
+                        CsvCellView *out, uint32_t maxCells,
+                        uint32_t *rowStarts) {
+  rowStarts[0] = 0;
+  if (csv == nullptr || firstRow >= csv->numRows64) {
+    return 0;
+  }
+  if (nRows > csv->numRows64 - firstRow) {
+    nRows = (uint32_t)(csv->numRows64 - firstRow);
+  }
+  uint32_t nCells = 0;
+  uint32_t r = 0;
+  if (csv->snapshot != nullptr) {
+    // The cells of a snapshot are already in one array
+    const uint64_t *rows = snapRows(csv);
+    const SnapCell *cells = snapCells(csv);
+    for (; r < nRows; r++) {
+      uint64_t first = rows[firstRow + r];
+      uint64_t n = rows[firstRow + r + 1] - first;
+      if (n > maxCells - nCells) {
+        break;
+      }
+      for (uint64_t k = 0; k < n; k++) {
+        CsvCellView *view = &out[nCells++];
+        view->contents = snapText(csv, &cells[first + k]);
+        view->bytes = view->contents ? cells[first + k].bytes : 0;
+        view->flags = view->contents ? (uint8_t)cells[first + k].flags : 0;
+      }
+      rowStarts[r + 1] = nCells;
+    }
+    return r;
+  }
+  RowType **rows = &csv->rowLookup[firstRow];
+  for (; r < nRows; r++) {
+    if (r + ROWPREFETCH < nRows) {
+      PREFETCH(rows[r + ROWPREFETCH]);
+    }
+    if (r + ROWPREFETCH / 2 < nRows) {
+      PREFETCH(rows[r + ROWPREFETCH / 2]->first);
+    }
+    const RowType *row = rows[r];
+    if (row->numCols > maxCells - nCells) {
+      break;
+    }
+    for (const CellType *cellPtr = row->first; cellPtr != nullptr;
+         cellPtr = cellPtr->next) {
+      CsvCellView *view = &out[nCells++];
+      view->contents = cellPtr->cell.cellContents;
+      view->bytes = cellPtr->cell.bytes;
+      view->flags = cellPtr->cell.flags;
+    }
+    rowStarts[r + 1] = nCells;
+  }
+  return r;
+}
+
+CsvStats csvGetStats(CsvType *csv) {
+  CsvStats stats;
+  memset((void *)&stats, 0, sizeof(stats));
+  if (csv != nullptr) {
+    stats = csv->stats;
+  }
+  return stats;
+}
+
+const CsvError *csvGetErrors(CsvType *csv, uint32_t *nErrors,
+                             uint64_t *totalErrors) {
+  *nErrors = (csv != nullptr) ? csv->nErrors : 0;
+  if (totalErrors != nullptr) {
+    *totalErrors = (csv != nullptr) ? csv->errorCount : 0;
+  }
+  return (csv != nullptr) ? csv->errors : nullptr;
+}
+
+////////////////////////////////////////////////////
+// Dictionary encoded columns
+////////////////////////////////////////////////////
+const uint32_t *csvColumnCodes(CsvType *csv, uint32_t col, uint32_t *nCodes) {
+  CsvDict *dict = (csv != nullptr) ? findDict(csv, col) : nullptr;
+  if (dict == nullptr || !rowIdsFit(csv)) {
+    *nCodes = 0;
+    return nullptr;
+  }
+  *nCodes = dict->nCodes;
+  return dict->codes;
+}
+
+uint32_t csvDictSize(CsvType *csv, uint32_t col) {
+  CsvDict *dict = (csv != nullptr) ? findDict(csv, col) : nullptr;
+  return (dict != nullptr) ? dict->nStrings : 0;
+}
+
+const char *csvDictString(CsvType *csv, uint32_t col, uint32_t code) {
+  CsvDict *dict = (csv != nullptr) ? findDict(csv, col) : nullptr;
+  if (dict == nullptr || code >= dict->nStrings) {
+    return nullptr;
+  }
+  return dict->strings[code];
+}
+
+////////////////////////////////////////////////////
+// Find the cell at col in a row, or nullptr if the row is too short
+////////////////////////////////////////////////////
+static CellType *findCell(RowType *rowPtr, uint32_t col) {
+  if (rowPtr == nullptr) {
+    return nullptr;
+  }
+  CellType *cellPtr = rowPtr->first;
+  for (uint32_t c = 0; cellPtr != nullptr && c < col; c++) {
+    cellPtr = cellPtr->next;
+  }
+  return cellPtr;
+}
+
+////////////////////////////////////////////////////
+// The text of a cell, from the tree or a snapshot.
+// Empty cells give "". Returns false if the row is too short.
+////////////////////////////////////////////////////
+static bool cellText(CsvType *csv, uint32_t row, uint32_t col,
+                     const char **text, uint32_t *bytes) {
+  if (csv->snapshot != nullptr) {
+    CsvCellType cell = getSnapCell(csv, row, col);
+    if (cell.status == missingCol) {
+      return false;
+    }
+    *text = cell.cellContents ? cell.cellContents : "";
+    *bytes = cell.bytes;
+    return true;
+  }
+  CellType *cellPtr = findCell(csv->rowLookup[row], col);
+  if (cellPtr == nullptr) {
+    return false;
+  }
+  *text = cellPtr->cell.cellContents ? cellPtr->cell.cellContents : "";
+  *bytes = cellPtr->cell.bytes;
+  return true;
+}
+
+////////////////////////////////////////////////////
+// Threads used for the parallel helpers. Small jobs are not worth
+// the cost of starting threads, so they get fewer (or just one).
+////////////////////////////////////////////////////
+#define MAXTHREADS 64
+#define MINITEMSPERTHREAD 16384
+
+static uint32_t numThreadsFor(uint64_t nItems) {
+  long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t nThreads = (nCpus > 0) ? (uint32_t)nCpus : 1;
+  if (nThreads > MAXTHREADS) {
+    nThreads = MAXTHREADS;
+  }
+  uint64_t wanted = nItems / MINITEMSPERTHREAD;
+  if (wanted < nThreads) {
+    nThreads = (uint32_t)wanted;
+  }
+  return nThreads < 1 ? 1 : nThreads;
+}
+
+typedef void (*RangeFunc)(void *arg, uint64_t first, uint64_t last);
+
+typedef struct RangeJob {
+  RangeFunc func;
+  void *arg;
+  uint64_t first;
+  uint64_t last;
+} RangeJob;
+
+static void *rangeJobMain(void *jobPtr) {
+  RangeJob *job = (RangeJob *)jobPtr;
+  job->func(job->arg, job->first, job->last);
+  return nullptr;
+}
+
+////////////////////////////////////////////////////
+// Split [0, nItems) into nThreads contiguous ranges and run func on
+// each range in its own thread. The calling thread takes the first range.
+// If a thread cannot be started its range is run inline.
+////////////////////////////////////////////////////
+static void parallelForThreads(uint64_t nItems, uint32_t nThreads,
+                               RangeFunc func, void *arg) {
+  if (nThreads > MAXTHREADS) {
+    nThreads = MAXTHREADS;
+  }
+  if (nThreads < 1) {
+    nThreads = 1;
+  }
+  RangeJob jobs[MAXTHREADS];
+  pthread_t threads[MAXTHREADS];
+  bool started[MAXTHREADS];
+  uint64_t perThread = nItems / nThreads;
+  for (uint32_t t = 0; t < nThreads; t++) {
+    jobs[t].func = func;
+    jobs[t].arg = arg;
+    jobs[t].first = t * perThread;
+    jobs[t].last = (t == nThreads - 1) ? nItems : (t + 1) * perThread;
+    started[t] = false;
+  }
+  for (uint32_t t = 1; t < nThreads; t++) {
+    started[t] =
+        (pthread_create(&threads[t], nullptr, rangeJobMain, &jobs[t]) == 0);
+  }
+  rangeJobMain(&jobs[0]);
+  for (uint32_t t = 1; t < nThreads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], nullptr);
+    } else {
+      rangeJobMain(&jobs[t]);
+    }
+  }
+}
+
+static void parallelFor(uint64_t nItems, RangeFunc func, void *arg) {
+  parallelForThreads(nItems, numThreadsFor(nItems), func, arg);
+}
+
+////////////////////////////////////////////////////
+// Free a csv tree using several threads, each freeing a range of rows
+////////////////////////////////////////////////////
+static void freeRowRange(void *arg, uint64_t first, uint64_t last) {
+  CsvType *csv = (CsvType *)arg;
+  for (uint64_t r = first; r < last; r++) {
+    freeRow(csv, csv->rowLookup[r]);
+  }
+}
+
+void freeMemParallel(CsvType *csv) {
+  if (csv == nullptr || csv->snapshot != nullptr) {
+    freeMem(csv);
+    return;
+  }
+  parallelFor(csv->numRows64, freeRowRange, csv);
+  freeDicts(csv);
+  csvFree(csv, csv->errors);
+  csvFree(csv, csv->rowLookup);
+  freeCsv(csv);
+}
+
+////////////////////////////////////////////////////
+// Background freeing.
+// freeMemAsync() puts the tree on a queue and returns at once. A
+// reclaimer thread, started the first time it is needed, frees the
+// trees on the queue. If there is no memory for the queue entry, or
+// the thread cannot be started, the tree is freed on the spot.
+////////////////////////////////////////////////////
+typedef struct ReclaimEntry {
+  CsvType *csv;
+  struct ReclaimEntry *next;
+} ReclaimEntry;
+
+static pthread_mutex_t reclaimLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaimWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reclaimDone = PTHREAD_COND_INITIALIZER;
+static ReclaimEntry *reclaimHead = nullptr;
+static ReclaimEntry *reclaimTail = nullptr;
+static uint32_t reclaimPending = 0;
+static bool reclaimerRunning = false;
+
+static void *reclaimerMain(void *unused) {
+  (void)unused;
+  pthread_mutex_lock(&reclaimLock);
+  for (;;) {
+    while (reclaimHead == nullptr) {
+      pthread_cond_wait(&reclaimWork, &reclaimLock);
+    }
+    ReclaimEntry *entry = reclaimHead;
+    reclaimHead = entry->next;
+    if (reclaimHead == nullptr) {
+      reclaimTail = nullptr;
+    }
+    pthread_mutex_unlock(&reclaimLock);
+    freeMem(entry->csv);
+    free(entry);
+    pthread_mutex_lock(&reclaimLock);
+    reclaimPending--;
+    if (reclaimPending == 0) {
+      pthread_cond_broadcast(&reclaimDone);
+    }
+  }
+  return nullptr;
+}
+
+void freeMemAsync(CsvType *csv) {
+  if (csv == nullptr) {
+    return;
+  }
+  ReclaimEntry *entry = (ReclaimEntry *)malloc(sizeof(ReclaimEntry));
+  if (entry == nullptr) {
+    freeMem(csv);
+    return;
+  }
+  entry->csv = csv;
+  entry->next = nullptr;
+  pthread_mutex_lock(&reclaimLock);
+  if (!reclaimerRunning) {
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, reclaimerMain, nullptr) == 0) {
+      pthread_detach(thread);
+      reclaimerRunning = true;
+    }
+  }
+  if (!reclaimerRunning) {
+    pthread_mutex_unlock(&reclaimLock);
+    free(entry);
+    freeMem(csv);
+    return;
+  }
+  if (reclaimTail == nullptr) {
+    reclaimHead = entry;
+  } else {
+    reclaimTail->next = entry;
+  }
+  reclaimTail = entry;
+  reclaimPending++;
+  pthread_cond_signal(&reclaimWork);
+  pthread_mutex_unlock(&reclaimLock);
+}
+
+void csvWaitForFrees(void) {
+  pthread_mutex_lock(&reclaimLock);
+  while (reclaimPending > 0) {
+    pthread_cond_wait(&reclaimDone, &reclaimLock);
+  }
+  pthread_mutex_unlock(&reclaimLock);
+}
+
+////////////////////////////////////////////////////
+// Hash index over one column of a csv tree.
+// Open addressing with linear probing. Each slot holds the top 32 bits
+// of the hash and (rowId + 1), so 0 is an empty slot and most
+// mismatches are rejected without touching the cell bytes.
+// The key bytes of every row are cached so probes never walk the
+// cell lists.
+////////////////////////////////////////////////////
+struct CsvHashIndex {
+  CsvType *csv;
+  uint32_t keyCol;
+  uint64_t mask;
+  uint64_t *slots;
+  const char **keys; // per row, nullptr if the row has no such column
+  uint32_t *keyBytes;
+};
+
+#define HASHBATCH 16
+
+static inline uint64_t makeSlot(uint64_t hash, uint32_t rowId) {
+  return (hash & 0xFFFFFFFF00000000ULL) | (uint64_t)(rowId + 1);
+}
+
+static void hashIndexInsertRange(void *arg, uint64_t first, uint64_t last) {
+  CsvHashIndex *index = (CsvHashIndex *)arg;
+  for (uint32_t r = (uint32_t)first; r < last; r++) {
+    if (!cellText(index->csv, r, index->keyCol, &index->keys[r],
+                  &index->keyBytes[r])) {
+      index->keys[r] = nullptr;
+      index->keyBytes[r] = 0;
+      continue;
+    }
+    uint64_t hash = hashBytes(index->keys[r], index->keyBytes[r]);
+    uint64_t slot = makeSlot(hash, r);
+    uint64_t pos = hash & index->mask;
+    // Other threads insert at the same time, so claim slots with a CAS
+    for (;;) {
+      uint64_t expected = 0;
+      if (__atomic_compare_exchange_n(&index->slots[pos], &expected, slot,
+                                      false, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+      pos = (pos + 1) & index->mask;
+    }
+  }
+}
+
+////////////////////////////////////////////////////
+// Build a hash index on keyCol. Rows too short to have keyCol are
+// not indexed, empty cells are indexed as an empty key.
+// The index refers to the cells of csv, so free the index first.
+////////////////////////////////////////////////////
+CsvHashIndex *csvBuildHashIndex(CsvType *csv, uint32_t keyCol) {
+  if (csv == nullptr || !rowIdsFit(csv)) {
+    return nullptr;
+  }
+  CsvHashIndex *index = (CsvHashIndex *)malloc(sizeof(CsvHashIndex));
+  if (index == nullptr) {
+    return nullptr;
+  }
+  uint64_t nSlots = 16;
+  while (nSlots < 2 * (uint64_t)csv->numRows) {
+    nSlots <<= 1;
+  }
+  index->csv = csv;
+  index->keyCol = keyCol;
+  index->mask = nSlots - 1;
+  index->slots = (uint64_t *)calloc(nSlots, sizeof(uint64_t));
+  index->keys = (const char **)malloc((csv->numRows + 1) * sizeof(char *));
+  index->keyBytes = (uint32_t *)malloc((csv->numRows + 1) * sizeof(uint32_t));
+  if (index->slots == nullptr || index->keys == nullptr ||
+      index->keyBytes == nullptr) {
+    csvFreeHashIndex(index);
+    return nullptr;
+  }
+  parallelFor(csv->numRows, hashIndexInsertRange, index);
+  return index;
+}
+
+void csvFreeHashIndex(CsvHashIndex *index) {
+  if (index == nullptr) {
+    return;
+  }
+  free(index->slots);
+  free((void *)index->keys);
+  free(index->keyBytes);
+  free(index);
+}
+
+static int compareRowIds(const void *a, const void *b) {
+  uint32_t ra = *(const uint32_t *)a;
+  uint32_t rb = *(const uint32_t *)b;
+  return (ra > rb) - (ra < rb);
+}
+
+////////////////////////////////////////////////////
+// Walk the probe sequence for a key and call back for every match.
+// Returns the number of matches.
+////////////////////////////////////////////////////
+typedef void (*MatchFunc)(void *arg, uint32_t rowId);
+
+static uint32_t probeIndex(CsvHashIndex *index, uint64_t hash,
+                           const char *key, uint32_t len, MatchFunc func,
+                           void *arg) {
+  uint64_t tag = hash & 0xFFFFFFFF00000000ULL;
+  uint64_t pos = hash & index->mask;
+  uint32_t nMatches = 0;
+  uint64_t slot;
+  while ((slot = index->slots[pos]) != 0) {
+    if ((slot & 0xFFFFFFFF00000000ULL) == tag) {
+      uint32_t rowId = (uint32_t)(slot & 0xFFFFFFFFULL) - 1;
+      if (index->keyBytes[rowId] == len &&
+          memcmp(index->keys[rowId], key, len) == 0) {
+        func(arg, rowId);
+        nMatches++;
+      }
+    }
+    pos = (pos + 1) & index->mask;
+  }
+  return nMatches;
+}
+
+typedef struct LookupResult {
+  uint32_t *rowIds;
+  uint32_t maxRowIds;
+  uint32_t count;
+} LookupResult;
+
+static void addLookupMatch(void *arg, uint32_t rowId) {
+  LookupResult *result = (LookupResult *)arg;
+  if (result->count < result->maxRowIds) {
+    result->rowIds[result->count] = rowId;
+  }
+  result->count++;
+}
+
+////////////////////////////////////////////////////
+// Find the rows whose key column equals key.
+// Up to maxRowIds matching row ids are put in rowIds, sorted.
+// Returns the total number of matches, which may be more than
+// maxRowIds, in which case call again with a bigger array.
+////////////////////////////////////////////////////
+uint32_t csvLookup(CsvHashIndex *index, const char *key, uint32_t *rowIds,
+                   uint32_t maxRowIds) {
+  if (index == nullptr || key == nullptr) {
+    return 0;
+  }
+  uint32_t len = strlen(key);
+  LookupResult result = {rowIds, maxRowIds, 0};
+  probeIndex(index, hashBytes(key, len), key, len, addLookupMatch, &result);
+  uint32_t nSorted = result.count < maxRowIds ? result.count : maxRowIds;
+  qsort(rowIds, nSorted, sizeof(uint32_t), compareRowIds);
+  return result.count;
+}
+
+typedef struct JoinResult {
+  CsvRowPair *pairs;
+  uint64_t count;
+  uint64_t capacity;
+  uint32_t leftRow;
+  bool outOfMemory;
+} JoinResult;
+
+static void addJoinMatch(void *arg, uint32_t rowId) {
+  JoinResult *result = (JoinResult *)arg;
+  if (result->count == result->capacity) {
+    uint64_t capacity = result->capacity ? 2 * result->capacity : 1024;
+    CsvRowPair *pairs =
+        (CsvRowPair *)realloc(result->pairs, capacity * sizeof(CsvRowPair));
+    if (pairs == nullptr) {
+      result->outOfMemory = true;
+      return;
+    }
+    result->pairs = pairs;
+    result->capacity = capacity;
+  }
+  result->pairs[result->count].leftRow = result->leftRow;
+  result->pairs[result->count].rightRow = rowId;
+  result->count++;
+}
+
+static int compareRowPairs(const void *a, const void *b) {
+  const CsvRowPair *pa = (const CsvRowPair *)a;
+  const CsvRowPair *pb = (const CsvRowPair *)b;
+  return (pa->rightRow > pb->rightRow) - (pa->rightRow < pb->rightRow);
+}
+
+////////////////////////////////////////////////////
+// Inner join of left (on leftCol) with the rows of rightIndex.
+// Left rows are probed in batches: the hashes of a batch are worked out
+// and their first slots prefetched before any of them are probed, so
+// the cache misses overlap instead of being taken one at a time.
+// Pairs are ordered by left row, then right row.
+// The returned array is malloc'ed, free() it when done. No matches is
+// an array of no pairs, so nullptr always means the join failed.
+////////////////////////////////////////////////////
+CsvRowPair *csvJoin(CsvType *left, uint32_t leftCol, CsvHashIndex *rightIndex,
+                    uint64_t *nPairs) {
+  *nPairs = 0;
+  if (left == nullptr || rightIndex == nullptr || !rowIdsFit(left)) {
+    return nullptr;
+  }
+  JoinResult result = {nullptr, 0, 0, 0, false};
+  const char *keys[HASHBATCH];
+  uint32_t lens[HASHBATCH];
+  uint64_t hashes[HASHBATCH];
+  for (uint32_t batch = 0; batch < left->numRows; batch += HASHBATCH) {
+    uint32_t nBatch = left->numRows - batch;
+    if (nBatch > HASHBATCH) {
+      nBatch = HASHBATCH;
+    }
+    for (uint32_t b = 0; b < nBatch; b++) {
+      if (!cellText(left, batch + b, leftCol, &keys[b], &lens[b])) {
+        keys[b] = nullptr;
+      } else {
+        hashes[b] = hashBytes(keys[b], lens[b]);
+        PREFETCH(&rightIndex->slots[hashes[b] & rightIndex->mask]);
+      }
+    }
+    for (uint32_t b = 0; b < nBatch; b++) {
+      if (keys[b] == nullptr) {
+        continue;
+      }
+      uint64_t firstPair = result.count;
+      result.leftRow = batch + b;
+      probeIndex(rightIndex, hashes[b], keys[b], lens[b], addJoinMatch,
+                 &result);
+      if (result.outOfMemory) {
+        free(result.pairs);
+        return nullptr;
+      }
+      if (result.count - firstPair > 1) {
+        qsort(&result.pairs[firstPair], result.count - firstPair,
+              sizeof(CsvRowPair), compareRowPairs);
+      }
+    }
+  }
+  if (result.pairs == nullptr) {
+    // Nothing matched, which is not a failure
+    return (CsvRowPair *)malloc(sizeof(CsvRowPair));
+  }
+  *nPairs = result.count;
+  return result.pairs;
+}
+
+////////////////////////////////////////////////////
+// Sorting rows.
+// Only rowLookup (and the row ids) are reordered, the cells stay
+// where they are. The sort keys are first pulled out of the cells
+// into flat arrays so the compares never walk the cell lists.
+////////////////////////////////////////////////////
+typedef struct SortKeyData {
+  const char **strings;
+  uint32_t *lens;
+  double *numbers;
+} SortKeyData;
+
+typedef struct SortContext {
+  CsvType *csv;
+  const CsvSortKey *keys;
+  uint32_t nKeys;
+  SortKeyData *data;
+  uint32_t *perm;
+  uint32_t *tmp;
+  uint32_t *bounds; // chunk boundaries for the parallel merge sort
+  uint32_t width;   // chunks per run in the current merge round
+  uint32_t nChunks;
+} SortContext;
+
+static double cellNumber(CellType *cellPtr) {
+  if (cellPtr == nullptr || cellPtr->cell.cellContents == nullptr) {
+    return NAN;
+  }
+  // Up to 15 digits is exact in a double, so strtod() is not needed
+  if ((cellPtr->cell.flags & CSV_CELL_DIGITS) && cellPtr->cell.bytes <= 15) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < cellPtr->cell.bytes; i++) {
+      value = value * 10 + (uint64_t)(cellPtr->cell.cellContents[i] - '0');
+    }
+    return (double)value;
+  }
+  // A quoted number is read without its quotes. Numbers are short,
+  // a cell too long for text is not one.
+  char text[64];
+  const char *number = cellPtr->cell.cellContents;
+  if (cellPtr->cell.flags & CSV_CELL_QUOTED) {
+    if (csvUnescapeCell(&cellPtr->cell, text, sizeof(text)) >= sizeof(text)) {
+      return NAN;
+    }
+    number = text;
+  }
+  // Only the whole cell is a number, 12abc is not
+  char *end = nullptr;
+  double value = strtod(number, &end);
+  if (end == number || *end != '\0') {
+    return NAN;
+  }
+  return value;
+}
+
+static void extractSortKeys(void *arg, uint64_t first, uint64_t last) {
+  SortContext *ctx = (SortContext *)arg;
+  for (uint32_t r = (uint32_t)first; r < last; r++) {
+    RowType *rowPtr = ctx->csv->rowLookup[r];
+    for (uint32_t k = 0; k < ctx->nKeys; k++) {
+      CellType *cellPtr = findCell(rowPtr, ctx->keys[k].col);
+      SortKeyData *data = &ctx->data[k];
+      if (ctx->keys[k].type == csvSortNumeric) {
+        data->numbers[r] = cellNumber(cellPtr);
+      } else if (cellPtr == nullptr || cellPtr->cell.cellContents == nullptr) {
+        data->strings[r] = "";
+        data->lens[r] = 0;
+      } else {
+        data->strings[r] = cellPtr->cell.cellContents;
+        data->lens[r] = cellPtr->cell.bytes;
+      }
+    }
+  }
+}
+
+////////////////////////////////////////////////////
+// Cells that are not numbers (NaN) go last, ascending or descending.
+// Otherwise descending is the exact reverse.
+////////////////////////////////////////////////////
+static int compareSortRows(SortContext *ctx, uint32_t a, uint32_t b) {
+  for (uint32_t k = 0; k < ctx->nKeys; k++) {
+    SortKeyData *data = &ctx->data[k];
+    int result = 0;
+    if (ctx->keys[k].type == csvSortNumeric) {
+      double na = data->numbers[a];
+      double nb = data->numbers[b];
+      if (isnan(na) || isnan(nb)) {
+        result = (isnan(na) != 0) - (isnan(nb) != 0);
+        if (result != 0) {
+          return result;
+        }
+      } else {
+        result = (na > nb) - (na < nb);
+      }
+    } else {
+      uint32_t len = data->lens[a] < data->lens[b] ? data->lens[a] : data->lens[b];
+      result = memcmp(data->strings[a], data->strings[b], len);
+      if (result == 0) {
+        result = (data->lens[a] > data->lens[b]) - (data->lens[a] < data->lens[b]);
+      }
+    }
+    if (result != 0) {
+      return ctx->keys[k].descending ? -result : result;
+    }
+  }
+  return 0;
+}
+
+// Merge the sorted runs src[lo, mid) and src[mid, hi) into dst[lo, hi).
+// Ties take the left run first, which keeps the sort stable.
+static void mergeRuns(SortContext *ctx, const uint32_t *src, uint32_t *dst,
+                      uint32_t lo, uint32_t mid, uint32_t hi) {
+  uint32_t i = lo;
+  uint32_t j = mid;
+  uint32_t out = lo;
+  while (i < mid && j < hi) {
+    if (compareSortRows(ctx, src[j], src[i]) < 0) {
+      dst[out++] = src[j++];
+    } else {
+      dst[out++] = src[i++];
+    }
+  }
+  while (i < mid) {
+    dst[out++] = src[i++];
+  }
+  while (j < hi) {
+    dst[out++] = src[j++];
+  }
+}
+
+// Bottom up merge sort of perm[lo, hi), leaving the result in perm
+static void mergeSortRange(SortContext *ctx, uint32_t lo, uint32_t hi) {
+  uint32_t *src = ctx->perm;
+  uint32_t *dst = ctx->tmp;
+  for (uint32_t width = 1; width < hi - lo; width *= 2) {
+    for (uint32_t start = lo; start < hi; start += 2 * width) {
+      uint32_t mid = start + width < hi ? start + width : hi;
+      uint32_t end = start + 2 * width < hi ? start + 2 * width : hi;
+      mergeRuns(ctx, src, dst, start, mid, end);
+    }
+    uint32_t *swap = src;
+    src = dst;
+    dst = swap;
+  }
+  if (src != ctx->perm) {
+    memcpy(&ctx->perm[lo], &src[lo], (hi - lo) * sizeof(uint32_t));
+  }
+}
+
+static void sortChunks(void *arg, uint64_t first, uint64_t last) {
+  SortContext *ctx = (SortContext *)arg;
+  for (uint32_t c = (uint32_t)first; c < last; c++) {
+    mergeSortRange(ctx, ctx->bounds[c], ctx->bounds[c + 1]);
+  }
+}
+
+static void mergeChunks(void *arg, uint64_t first, uint64_t last) {
+  SortContext *ctx = (SortContext *)arg;
+  for (uint32_t m = (uint32_t)first; m < last; m++) {
+    uint32_t c = m * 2 * ctx->width;
+    uint32_t mid = c + ctx->width;
+    uint32_t end = c + 2 * ctx->width;
+    if (mid >= ctx->nChunks) {
+      continue;
+    }
+    if (end > ctx->nChunks) {
+      end = ctx->nChunks;
+    }
+    uint32_t lo = ctx->bounds[c];
+    uint32_t hi = ctx->bounds[end];
+    mergeRuns(ctx, ctx->perm, ctx->tmp, lo, ctx->bounds[mid], hi);
+    memcpy(&ctx->perm[lo], &ctx->tmp[lo], (hi - lo) * sizeof(uint32_t));
+  }
+}
+
+////////////////////////////////////////////////////
+// Each thread sorts one chunk of the rows, then pairs of sorted
+// chunks are merged, also in parallel, until one run is left.
+////////////////////////////////////////////////////
+static void parallelMergeSort(SortContext *ctx, uint32_t nRows) {
+  uint32_t nChunks = numThreadsFor(nRows);
+  uint32_t bounds[MAXTHREADS + 1];
+  for (uint32_t c = 0; c <= nChunks; c++) {
+    bounds[c] = (uint32_t)((uint64_t)nRows * c / nChunks);
+  }
+  ctx->bounds = bounds;
+  ctx->nChunks = nChunks;
+  parallelForThreads(nChunks, nChunks, sortChunks, ctx);
+  for (ctx->width = 1; ctx->width < nChunks; ctx->width *= 2) {
+    uint32_t nMerges = (nChunks + 2 * ctx->width - 1) / (2 * ctx->width);
+    parallelForThreads(nMerges, nMerges, mergeChunks, ctx);
+  }
+}
+
+////////////////////////////////////////////////////
+// Map a double to a 64 bit key with the same order.
+// NaN sorts after everything else, in either direction.
+////////////////////////////////////////////////////
+static uint64_t numberSortKey(double value, bool descending) {
+  uint64_t bits;
+  if (isnan(value)) {
+    return UINT64_MAX;
+  } else {
+    if (value == 0.0) {
+      value = 0.0; // -0 and +0 are equal
+    }
+    memcpy(&bits, &value, sizeof(bits));
+    bits = (bits & 0x8000000000000000ULL) ? ~bits
+                                           : bits | 0x8000000000000000ULL;
+  }
+  return descending ? ~bits : bits;
+}
+
+////////////////////////////////////////////////////
+// LSD radix sort of perm on 64 bit keys, 16 bits per pass.
+// Passes where every key has the same digit are skipped.
+////////////////////////////////////////////////////
+#define RADIXBITS 16
+#define RADIXSIZE (1 << RADIXBITS)
+
+static bool radixSortRows(SortContext *ctx, uint32_t nRows) {
+  uint64_t *keys = (uint64_t *)malloc(nRows * sizeof(uint64_t));
+  uint64_t *keysTmp = (uint64_t *)malloc(nRows * sizeof(uint64_t));
+  uint32_t *counts = (uint32_t *)malloc(RADIXSIZE * sizeof(uint32_t));
+  if (keys == nullptr || keysTmp == nullptr || counts == nullptr) {
+    free(keys);
+    free(keysTmp);
+    free(counts);
+    return false;
+  }
+  for (uint32_t r = 0; r < nRows; r++) {
+    keys[r] = numberSortKey(ctx->data[0].numbers[r], ctx->keys[0].descending);
+  }
+  uint32_t *perm = ctx->perm;
+  uint32_t *permTmp = ctx->tmp;
+  for (uint32_t shift = 0; shift < 64; shift += RADIXBITS) {
+    memset(counts, 0, RADIXSIZE * sizeof(uint32_t));
+    for (uint32_t r = 0; r < nRows; r++) {
+      counts[(keys[r] >> shift) & (RADIXSIZE - 1)]++;
+    }
+    if (counts[(keys[0] >> shift) & (RADIXSIZE - 1)] == nRows) {
+      continue;
+    }
+    uint32_t total = 0;
+    for (uint32_t d = 0; d < RADIXSIZE; d++) {
+      uint32_t count = counts[d];
+      counts[d] = total;
+      total += count;
+    }
+    for (uint32_t r = 0; r < nRows; r++) {
+      uint32_t dest = counts[(keys[r] >> shift) & (RADIXSIZE - 1)]++;
+      keysTmp[dest] = keys[r];
+      permTmp[dest] = perm[r];
+    }
+    uint64_t *swapKeys = keys;
+    keys = keysTmp;
+    keysTmp = swapKeys;
+    uint32_t *swapPerm = perm;
+    perm = permTmp;
+    permTmp = swapPerm;
+  }
+  if (perm != ctx->perm) {
+    memcpy(ctx->perm, perm, nRows * sizeof(uint32_t));
+  }
+  free(keys);
+  free(keysTmp);
+  free(counts);
+  return true;
+}
+
+static void freeSortKeys(SortContext *ctx) {
+  for (uint32_t k = 0; k < ctx->nKeys; k++) {
+    free((void *)ctx->data[k].strings);
+    free(ctx->data[k].lens);
+    free(ctx->data[k].numbers);
+  }
+  free(ctx->data);
+}
+
+////////////////////////////////////////////////////
+// Sort the rows of csv by one or more columns. The sort is stable.
+// A single numeric key uses a radix sort, anything else a parallel
+// merge sort. Returns false if memory ran out (csv is unchanged).
+////////////////////////////////////////////////////
+bool csvSortRows(CsvType *csv, const CsvSortKey *keys, uint32_t nKeys) {
+  if (csv == nullptr || csv->snapshot != nullptr || !rowIdsFit(csv)) {
+    // A snapshot is read only
+    return false;
+  }
+  if (csv->rowLookup == nullptr || nKeys == 0) {
+    return true;
+  }
+  uint32_t nRows = csv->numRows;
+  SortContext ctx;
+  memset((void *)&ctx, 0, sizeof(ctx));
+  ctx.csv = csv;
+  ctx.keys = keys;
+  ctx.nKeys = nKeys;
+  ctx.data = (SortKeyData *)calloc(nKeys, sizeof(SortKeyData));
+  ctx.perm = (uint32_t *)malloc((nRows + 1) * sizeof(uint32_t));
+  ctx.tmp = (uint32_t *)malloc((nRows + 1) * sizeof(uint32_t));
+  RowType **rows = (RowType **)malloc((nRows + 1) * sizeof(RowType *));
+  bool ok = (ctx.data != nullptr && ctx.perm != nullptr && ctx.tmp != nullptr &&
+             rows != nullptr);
+  for (uint32_t k = 0; ok && k < nKeys; k++) {
+    if (keys[k].type == csvSortNumeric) {
+      ctx.data[k].numbers = (double *)malloc((nRows + 1) * sizeof(double));
+      ok = (ctx.data[k].numbers != nullptr);
+    } else {
+      ctx.data[k].strings =
+          (const char **)malloc((nRows + 1) * sizeof(char *));
+      ctx.data[k].lens = (uint32_t *)malloc((nRows + 1) * sizeof(uint32_t));
+      ok = (ctx.data[k].strings != nullptr && ctx.data[k].lens != nullptr);
+    }
+  }
+  if (ok) {
+    parallelFor(nRows, extractSortKeys, &ctx);
+    for (uint32_t r = 0; r < nRows; r++) {
+      ctx.perm[r] = r;
+    }
+    if (nKeys == 1 && keys[0].type == csvSortNumeric) {
+      ok = radixSortRows(&ctx, nRows);
+    } else {
+      parallelMergeSort(&ctx, nRows);
+    }
+  }
+  if (ok) {
+    // Apply the new order, renumbering and relinking the rows as we go
+    for (uint32_t r = 0; r < nRows; r++) {
+      rows[r] = csv->rowLookup[ctx.perm[r]];
+      rows[r]->rowId = r;
+      if (r > 0) {
+        rows[r - 1]->next = rows[r];
+      }
+    }
+    if (nRows > 0) {
+      rows[nRows - 1]->next = nullptr;
+      csv->firstRow = rows[0];
+    }
+    memcpy(csv->rowLookup, rows, nRows * sizeof(RowType *));
+    for (uint32_t d = 0; d < csv->nDicts; d++) {
+      CsvDict *dict = &csv->dicts[d];
+      for (uint32_t r = 0; r < nRows; r++) {
+        ctx.tmp[r] = dict->codes[ctx.perm[r]];
+      }
+      memcpy(dict->codes, ctx.tmp, nRows * sizeof(uint32_t));
+    }
+  }
+  if (ctx.data != nullptr) {
+    freeSortKeys(&ctx);
+  }
+  free(ctx.perm);
+  free(ctx.tmp);
+  free(rows);
+  return ok;
+}
+
+////////////////////////////////////////////////////
+// Write csv to a snapshot file, see SnapHeader for the layout.
+// Works for a tree or another snapshot.
+////////////////////////////////////////////////////
+bool csvSaveSnapshot(CsvType *csv, const char *path) {
+  if (csv == nullptr) {
+    return false;
+  }
+  FILE *fp = fopen(path, "wb");
+  if (fp == nullptr) {
+    if (DEBUGME > 0)
+      fprintf(stderr, "Unable to write %s\n", path);
+    return false;
+  }
+  SnapHeader header;
+  memset((void *)&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPMAGIC, sizeof(header.magic));
+  header.version = SNAPVERSION;
+  header.headerBytes = sizeof(SnapHeader);
+  header.numRows = csv->numRows64;
+  header.numCols = csv->numCols;
+  CsvCellView view;
+  for (uint64_t r = 0; r < csv->numRows64; r++) {
+    CsvRowCursor cursor = csvRowCursor64(csv, r);
+    while (csvRowNext(&cursor, &view)) {
+      header.nCells++;
+    }
+  }
+  header.rowsOffset = sizeof(SnapHeader);
+  header.cellsOffset = header.rowsOffset + (header.numRows + 1) * sizeof(uint64_t);
+  header.dataOffset = header.cellsOffset + header.nCells * sizeof(SnapCell);
+  bool ok = (fwrite(&header, sizeof(header), 1, fp) == 1);
+
+  // Row table
+  uint64_t firstCell = 0;
+  for (uint64_t r = 0; ok && r <= csv->numRows64; r++) {
+    ok = (fwrite(&firstCell, sizeof(firstCell), 1, fp) == 1);
+    if (r < csv->numRows64) {
+      CsvRowCursor cursor = csvRowCursor64(csv, r);
+      while (csvRowNext(&cursor, &view)) {
+        firstCell++;
+      }
+    }
+  }
+  // Cell table
+  uint64_t dataOffset = header.dataOffset;
+  for (uint64_t r = 0; ok && r < csv->numRows64; r++) {
+    CsvRowCursor cursor = csvRowCursor64(csv, r);
+    while (ok && csvRowNext(&cursor, &view)) {
+      SnapCell snapCell;
+      snapCell.offset = 0;
+      snapCell.bytes = 0;
+      snapCell.flags = 0;
+      if (view.contents != nullptr && view.bytes > 0) {
+        snapCell.offset = dataOffset;
+        snapCell.bytes = view.bytes;
+        snapCell.flags = view.flags;
+        dataOffset += view.bytes + 1;
+      }
+      ok = (fwrite(&snapCell, sizeof(snapCell), 1, fp) == 1);
+    }
+  }
+  // Cell text
+  for (uint64_t r = 0; ok && r < csv->numRows64; r++) {
+    CsvRowCursor cursor = csvRowCursor64(csv, r);
+    while (ok && csvRowNext(&cursor, &view)) {
+      if (view.contents != nullptr && view.bytes > 0) {
+        ok = (fwrite(view.contents, 1, view.bytes + 1, fp) == view.bytes + 1);
+      }
+    }
+  }
+  // Now the size is known, finish the header
+  header.fileBytes = dataOffset;
+  if (ok) {
+    ok = (fseek(fp, 0, SEEK_SET) == 0 &&
+          fwrite(&header, sizeof(header), 1, fp) == 1);
+  }
+  if (fclose(fp) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    if (DEBUGME > 0)
+      fprintf(stderr, "Unable to write %s\n", path);
+    remove(path);
+  }
+  return ok;
+}
+
+////////////////////////////////////////////////////
+// The row and cell tables of a snapshot whose header is good. Rows
+// must never go back or past the last cell, and every cell's text
+// must lie in the text area with its '\0' after it, so a corrupt
+// file can not send getCell() outside the mapping.
+////////////////////////////////////////////////////
+static bool snapTablesOk(const char *mapping, const SnapHeader *header,
+                         uint64_t fileBytes) {
+  const uint64_t *rows = (const uint64_t *)(mapping + header->rowsOffset);
+  if (rows[0] != 0 || rows[header->numRows] != header->nCells) {
+    return false;
+  }
+  for (uint64_t r = 0; r < header->numRows; r++) {
+    if (rows[r + 1] < rows[r] || rows[r + 1] - rows[r] > UINT32_MAX) {
+      return false;
+    }
+  }
+  const SnapCell *cells = (const SnapCell *)(mapping + header->cellsOffset);
+  for (uint64_t c = 0; c < header->nCells; c++) {
+    uint64_t offset = cells[c].offset;
+    if (offset == 0) {
+      continue;
+    }
+    if (offset < header->dataOffset || offset >= fileBytes ||
+        cells[c].bytes >= fileBytes - offset ||
+        mapping[offset + cells[c].bytes] != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////
+// Map a snapshot file read only. Processes that open the same file
+// share one copy of it in the page cache.
+// Opening checks the header and the row and cell tables, and reads
+// the byte after each cell's text, but copies nothing.
+////////////////////////////////////////////////////
+CsvType *csvOpenSnapshot(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    if (DEBUGME > 0)
+      fprintf(stderr, "Unable to read %s\n", path);
+    return nullptr;
+  }
+  struct stat info;
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && (uint64_t)info.st_size >= sizeof(SnapHeader)) {
+    mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    if (DEBUGME > 0)
+      fprintf(stderr, "Unable to map %s\n", path);
+    return nullptr;
+  }
+  uint64_t fileBytes = info.st_size;
+  const SnapHeader *header = (const SnapHeader *)mapping;
+  bool ok = memcmp(header->magic, SNAPMAGIC, sizeof(header->magic)) == 0 &&
+            header->version == SNAPVERSION &&
+            header->headerBytes == sizeof(SnapHeader) &&
+            header->fileBytes == fileBytes &&
+            header->numRows < fileBytes / sizeof(uint64_t) &&
+            header->numCols <= UINT32_MAX &&
+            header->rowsOffset == sizeof(SnapHeader) &&
+            header->cellsOffset ==
+                header->rowsOffset + (header->numRows + 1) * sizeof(uint64_t) &&
+            header->cellsOffset <= fileBytes &&
+            header->nCells <=
+                (fileBytes - header->cellsOffset) / sizeof(SnapCell) &&
+            header->dataOffset ==
+                header->cellsOffset + header->nCells * sizeof(SnapCell) &&
+            header->dataOffset <= fileBytes;
+  if (ok) {
+    ok = snapTablesOk((const char *)mapping, header, fileBytes);
+  }
+  CsvType *csv = ok ? (CsvType *)calloc(1, sizeof(CsvType)) : nullptr;
+  if (csv == nullptr) {
+    if (DEBUGME > 0)
+      fprintf(stderr, "%s is not a csv snapshot\n", path);
+    munmap(mapping, fileBytes);
+    return nullptr;
+  }
+  csv->allocator = defaultAllocator;
+  csv->snapshot = (const char *)mapping;
+  csv->snapshotBytes = fileBytes;
+  csv->numRows64 = header->numRows;
+  csv->numRows =
+      header->numRows < UINT32_MAX ? (uint32_t)header->numRows : UINT32_MAX;
+  csv->numCols = (uint32_t)header->numCols;
+  csv->stats.rows = header->numRows;
+  csv->stats.cells = header->nCells;
+  return csv;
+}
+
+////////////////////////////////////////////////////
+// Hot reloading.
+// Readers find the current csv through handle->current, and say they
+// are using it by counting themselves in readers[epoch & 1] first.
+// A reload builds the new csv off to the side, swaps it in, then waits
+// for the readers of the old one to go. Flipping epoch sends new
+// readers to the other counter, so the counter being waited on only
+// goes down. A reader may have counted itself just before a flip with
+// an epoch read just before the one before it, so both counters are
+// drained in turn before the old csv is freed.
+////////////////////////////////////////////////////
+struct CsvHandle {
+  char *filename;
+  CsvOptions opts;
+  uint32_t *dictCols; // our copy of opts.dictCols
+  CsvType *current;
+  uint64_t version;
+  uint32_t epoch;
+  // readers[0][0] and readers[1][0] are a cache line apart
+  uint64_t readers[2][8];
+  pthread_mutex_t lock;
+  pthread_t thread;
+  bool threadActive;
+  bool reloading; // Cleared by the thread when it is done
+  bool lastReloadOk;
+};
+
+static void waitForReaders(CsvHandle *handle) {
+  for (int phase = 0; phase < 2; phase++) {
+    uint32_t old = __atomic_fetch_add(&handle->epoch, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&handle->readers[old & 1][0], __ATOMIC_SEQ_CST) != 0) {
+      struct timespec pause = {0, 100000};
+      nanosleep(&pause, nullptr);
+    }
+  }
+}
+
+static void *reloadMain(void *handlePtr) {
+  CsvHandle *handle = (CsvHandle *)handlePtr;
+  bool opened = false;
+  CsvType *csv = loadCsv(handle->filename, &handle->opts, &opened);
+  if (!opened || csv->outOfMemory) {
+    // The version being read stays
+    freeMem(csv);
+    handle->lastReloadOk = false;
+    __atomic_store_n(&handle->reloading, false, __ATOMIC_RELEASE);
+    return nullptr;
+  }
+  CsvType *old = __atomic_exchange_n(&handle->current, csv, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&handle->version, 1, __ATOMIC_SEQ_CST);
+  waitForReaders(handle);
+  freeMem(old);
+  handle->lastReloadOk = true;
+  __atomic_store_n(&handle->reloading, false, __ATOMIC_RELEASE);
+  return nullptr;
+}
+
+////////////////////////////////////////////////////
+// Load filename and keep it ready for reloading.
+// Returns nullptr if the file can not be read.
+////////////////////////////////////////////////////
+CsvHandle *csvHandleOpen(const char *filename, const CsvOptions *opts) {
+  CsvOptions defaults;
+  if (opts == nullptr) {
+    csvDefaultOptions(&defaults);
+    opts = &defaults;
+  }
+  CsvHandle *handle = (CsvHandle *)calloc(1, sizeof(CsvHandle));
+  if (handle == nullptr) {
+    return nullptr;
+  }
+  handle->filename = strdup(filename);
+  handle->opts = *opts;
+  if (opts->nDictCols > 0) {
+    handle->dictCols = (uint32_t *)malloc(opts->nDictCols * sizeof(uint32_t));
+    if (handle->dictCols != nullptr) {
+      memcpy(handle->dictCols, opts->dictCols,
+             opts->nDictCols * sizeof(uint32_t));
+    }
+    handle->opts.dictCols = handle->dictCols;
+  }
+  bool opened = false;
+  if (handle->filename != nullptr &&
+      (opts->nDictCols == 0 || handle->dictCols != nullptr)) {
+    handle->current = loadCsv(filename, &handle->opts, &opened);
+  }
+  if (!opened) {
+    freeMem(handle->current);
+    free(handle->dictCols);
+    free(handle->filename);
+    free(handle);
+    return nullptr;
+  }
+  pthread_mutex_init(&handle->lock, nullptr);
+  handle->version = 1;
+  handle->lastReloadOk = true;
+  return handle;
+}
+
+////////////////////////////////////////////////////
+// Wait for a reload that is in progress. Returns true if the most
+// recent reload worked.
+////////////////////////////////////////////////////
+bool csvHandleWaitReload(CsvHandle *handle) {
+  pthread_mutex_lock(&handle->lock);
+  if (handle->threadActive) {
+    pthread_join(handle->thread, nullptr);
+    handle->threadActive = false;
+  }
+  bool ok = handle->lastReloadOk;
+  pthread_mutex_unlock(&handle->lock);
+  return ok;
+}
+
+////////////////////////////////////////////////////
+// Start reloading the file in the background. Returns false if a
+// reload is still in progress or a thread could not be started.
+////////////////////////////////////////////////////
+bool csvHandleReload(CsvHandle *handle) {
+  pthread_mutex_lock(&handle->lock);
+  if (handle->threadActive) {
+    if (__atomic_load_n(&handle->reloading, __ATOMIC_ACQUIRE)) {
+      pthread_mutex_unlock(&handle->lock);
+      return false;
+    }
+    pthread_join(handle->thread, nullptr);
+    handle->threadActive = false;
+  }
+  handle->reloading = true;
+  handle->threadActive =
+      (pthread_create(&handle->thread, nullptr, reloadMain, handle) == 0);
+  bool started = handle->threadActive;
+  if (!started) {
+    handle->reloading = false;
+  }
+  pthread_mutex_unlock(&handle->lock);
+  return started;
+}
+
+CsvHandleRef csvHandleAcquire(CsvHandle *handle) {
+  CsvHandleRef ref;
+  ref.epoch = __atomic_load_n(&handle->epoch, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&handle->readers[ref.epoch & 1][0], 1, __ATOMIC_SEQ_CST);
+  ref.csv = __atomic_load_n(&handle->current, __ATOMIC_SEQ_CST);
+  return ref;
+}
+
+void csvHandleRelease(CsvHandle *handle, CsvHandleRef ref) {
+  __atomic_fetch_sub(&handle->readers[ref.epoch & 1][0], 1, __ATOMIC_SEQ_CST);
+}
+
+uint64_t csvHandleVersion(CsvHandle *handle) {
+  return __atomic_load_n(&handle->version, __ATOMIC_SEQ_CST);
+}
+
+////////////////////////////////////////////////////
+// Finish any reload and free everything. No reader may still
+// hold a reference.
+////////////////////////////////////////////////////
+void csvHandleClose(CsvHandle *handle) {
+  if (handle == nullptr) {
+    return;
+  }
+  csvHandleWaitReload(handle);
+  freeMem(handle->current);
+  pthread_mutex_destroy(&handle->lock);
+  free(handle->dictCols);
+  free(handle->filename);
+  free(handle);
+}
+
+////////////////////////////////////////////////////
+// Loading many files at once.
+// Each worker thread has a deque of tasks. It pushes and pops at the
+// tail of its own and, when that is empty, steals from the head of
+// another's. A task is a whole file, or a chunk of records of a big
+// file. The task for a big file finds its record starts (from its row
+// index, or by scanning it) and pushes a task for each chunk of about
+// MANYCHUNKBYTES, so idle threads can steal them. The chunks of a file
+// are stitched back together in order once every task is done.
+////////////////////////////////////////////////////
+// Set it from the build to split small files
+#ifndef MANYCHUNKBYTES
+#define MANYCHUNKBYTES (16 * 1024 * 1024)
+#endif
+#define WHOLEFILE UINT32_MAX
+
+typedef struct LoadTask {
+  uint32_t file;
+  uint32_t chunk; // WHOLEFILE until the file is split
+} LoadTask;
+
+typedef struct WorkDeque {
+  pthread_mutex_t lock;
+  LoadTask *tasks;
+  uint32_t head; // thieves take from here
+  uint32_t tail; // the owner pushes and pops here
+  uint32_t capacity;
+} WorkDeque;
+
+typedef struct FileLoad {
+  const char *path;
+  CsvType *csv; // the whole file
+  // Set when the file is split. Chunk c starts at index.starts[
+  // chunkStarts[c]], the last runs to the end of the file.
+  RowIndex index;
+  uint32_t nChunks;
+  uint64_t *chunkStarts;
+  CsvType **chunks;
+} FileLoad;
+
+typedef struct LoadPool {
+  FileLoad *files;
+  const CsvOptions *opts;
+  uint32_t nThreads;
+  WorkDeque deques[MAXTHREADS];
+  uint64_t pending; // tasks pushed and not yet finished
+} LoadPool;
+
+typedef struct LoadWorker {
+  LoadPool *pool;
+  uint32_t id;
+} LoadWorker;
+
+// Returns false if there is no room, the caller runs the task itself
+static bool pushTask(LoadPool *pool, uint32_t id, LoadTask task) {
+  WorkDeque *deque = &pool->deques[id];
+  pthread_mutex_lock(&deque->lock);
+  if (deque->tail == deque->capacity) {
+    if (deque->head > 0) {
+      memmove(deque->tasks, &deque->tasks[deque->head],
+              (deque->tail - deque->head) * sizeof(LoadTask));
+      deque->tail -= deque->head;
+      deque->head = 0;
+    } else {
+      uint32_t capacity = deque->capacity ? 2 * deque->capacity : 64;
+      LoadTask *tasks =
+          (LoadTask *)realloc(deque->tasks, capacity * sizeof(LoadTask));
+      if (tasks == nullptr) {
+        pthread_mutex_unlock(&deque->lock);
+        return false;
+      }
+      deque->tasks = tasks;
+      deque->capacity = capacity;
+    }
+  }
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+  deque->tasks[deque->tail++] = task;
+  pthread_mutex_unlock(&deque->lock);
+  return true;
+}
+
+static bool popTask(WorkDeque *deque, LoadTask *task, bool steal) {
+  pthread_mutex_lock(&deque->lock);
+  bool found = (deque->head < deque->tail);
+  if (found) {
+    *task = steal ? deque->tasks[deque->head++] : deque->tasks[--deque->tail];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+// Load records [first, end) of a file whose record starts are known
+static CsvType *loadChunk(const char *path, const CsvOptions *opts,
+                          const RowIndex *index, uint64_t first,
+                          uint64_t end) {
+  CsvType *csv = newCsv(opts);
+  if (csv == nullptr) {
+    return nullptr;
+  }
+  FILE *fp = fopen(path, "r");
+  if (fp == nullptr) {
+    addError(csv, csvErrorUnreadable, 0, 0);
+    return csv;
+  }
+  RecordFilter filter;
+  clearFilter(&filter);
+  filter.first = first;
+  filter.end = end;
+  seekRecords(fp, index, first, end, &filter);
+  loadFile(csv, fp, opts, &filter);
+  fclose(fp);
+  return csv;
+}
+
+static void runChunk(FileLoad *load, const CsvOptions *opts, uint32_t chunk) {
+  const RowIndex *index = &load->index;
+  uint64_t first = load->chunkStarts[chunk] * index->stride;
+  uint64_t end = UINT64_MAX;
+  if (chunk + 1 < load->nChunks) {
+    end = load->chunkStarts[chunk + 1] * index->stride;
+  }
+  load->chunks[chunk] = loadChunk(load->path, opts, index, first, end);
+}
+
+////////////////////////////////////////////////////
+// Split a big file into chunks at record starts and push a task for
+// each. Returns false if the file is to be loaded whole: it is small,
+// UTF-16, or bad records may be skipped (skipping moves where the next
+// record starts, so the starts found beforehand would be wrong).
+////////////////////////////////////////////////////
+static bool splitFile(LoadPool *pool, uint32_t id, uint32_t file) {
+  FileLoad *load = &pool->files[file];
+  struct stat st;
+  if (pool->nThreads < 2 || pool->opts->errorPolicy == csvSkipRecord ||
+      stat(load->path, &st) != 0 || (uint64_t)st.st_size < 2 * MANYCHUNKBYTES) {
+    return false;
+  }
+  RowIndex *index = &load->index;
+  if (!loadRowIndex(load->path, &pool->opts->dialect, index)) {
+    FILE *fp = fopen(load->path, "r");
+    bool scanned = (fp != nullptr && scanRowIndex(fp, pool->opts, index));
+    if (fp != nullptr) {
+      fclose(fp);
+    }
+    if (!scanned) {
+      return false;
+    }
+  }
+  if (index->nStarts < 2) {
+    free(index->starts);
+    index->starts = nullptr;
+    return false;
+  }
+  load->chunkStarts =
+      (uint64_t *)malloc((index->nStarts + 1) * sizeof(uint64_t));
+  if (load->chunkStarts == nullptr) {
+    free(index->starts);
+    index->starts = nullptr;
+    return false;
+  }
+  uint32_t nChunks = 0;
+  load->chunkStarts[nChunks++] = 0;
+  for (uint64_t s = 1; s < index->nStarts; s++) {
+    uint64_t begin = index->starts[load->chunkStarts[nChunks - 1]];
+    if (index->starts[s] - begin >= MANYCHUNKBYTES) {
+      load->chunkStarts[nChunks++] = s;
+    }
+  }
+  load->chunks = (CsvType **)calloc(nChunks, sizeof(CsvType *));
+  if (load->chunks == nullptr) {
+    free(load->chunkStarts);
+    load->chunkStarts = nullptr;
+    free(index->starts);
+    index->starts = nullptr;
+    return false;
+  }
+  load->nChunks = nChunks;
+  for (uint32_t c = 0; c < nChunks; c++) {
+    LoadTask task = {file, c};
+    if (!pushTask(pool, id, task)) {
+      runChunk(load, pool->opts, c);
+    }
+  }
+  return true;
+}
+
+static void runTask(LoadPool *pool, uint32_t id, LoadTask task) {
+  FileLoad *load = &pool->files[task.file];
+  if (task.chunk == WHOLEFILE) {
+    if (!splitFile(pool, id, task.file)) {
+      bool opened = false;
+      load->csv = loadCsv(load->path, pool->opts, &opened);
+    }
+    return;
+  }
+  runChunk(load, pool->opts, task.chunk);
+}
+
+static void *loadWorkerMain(void *arg) {
+  LoadWorker *worker = (LoadWorker *)arg;
+  LoadPool *pool = worker->pool;
+  for (;;) {
+    LoadTask task;
+    bool found = popTask(&pool->deques[worker->id], &task, false);
+    for (uint32_t v = 1; !found && v < pool->nThreads; v++) {
+      found = popTask(&pool->deques[(worker->id + v) % pool->nThreads], &task,
+                      true);
+    }
+    if (found) {
+      runTask(pool, worker->id, task);
+      __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    } else if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) {
+      return nullptr;
+    } else {
+      // A split is still finding its chunks
+      struct timespec pause = {0, 100000};
+      nanosleep(&pause, nullptr);
+    }
+  }
+}
+
+// Intern the dictionary cells of a row of another csv in dst's
+// dictionaries. False if out of memory, the cell that failed still
+// points into the other csv's dictionary.
+static bool internRow(CsvType *dst, RowType *row) {
+  addDictRow(dst);
+  for (uint32_t d = 0; !dst->outOfMemory && d < dst->nDicts; d++) {
+    CsvDict *dict = &dst->dicts[d];
+    CellType *cellPtr = findCell(row, dict->col);
+    if (cellPtr == nullptr) {
+      continue;
+    }
+    const char *text = cellPtr->cell.cellContents;
+    uint32_t code = internString(dst, dict, text ? text : "",
+                                 cellPtr->cell.bytes);
+    if (code == CSV_NO_CODE) {
+      break;
+    }
+    if (row->rowId < dict->nCodes) {
+      dict->codes[row->rowId] = code;
+    }
+    if (cellPtr->interned) {
+      cellPtr->cell.cellContents = dict->strings[code];
+    }
+  }
+  return !dst->outOfMemory;
+}
+
+////////////////////////////////////////////////////
+// Move the rows of src to the end of dst and free what is left of src.
+// Cells of dictionary columns are interned again in dst's dictionary.
+// Both were made with the same allocator. If memory runs out, dst
+// keeps the rows moved so far and gets a csvErrorOutOfMemory error.
+// src may be nullptr, for a load that could not start.
+////////////////////////////////////////////////////
+static void appendCsv(CsvType *dst, CsvType *src) {
+  if (src == nullptr) {
+    dst->outOfMemory = true;
+    addError(dst, csvErrorOutOfMemory, dst->numRows64, 0);
+    return;
+  }
+  uint64_t base = dst->numRows64;
+  uint64_t n = src->numRows64;
+  if (base + n > dst->rowCapacity64) {
+    uint64_t capacity = 2 * dst->rowCapacity64;
+    capacity = (capacity < base + n) ? base + n : capacity;
+    RowType **rowLookup = (RowType **)csvRealloc(
+        dst, dst->rowLookup, (size_t)(capacity + 1) * sizeof(RowType *));
+    if (rowLookup == nullptr) {
+      n = 0;
+    } else {
+      dst->rowLookup = rowLookup;
+      dst->rowCapacity64 = capacity;
+      dst->rowCapacity =
+          capacity < UINT32_MAX ? (uint32_t)capacity : UINT32_MAX;
+    }
+  }
+  uint64_t moved = 0;
+  for (; moved < n; moved++) {
+    RowType *row = src->rowLookup[moved];
+    row->rowId = base + moved;
+    if (!internRow(dst, row)) {
+      break;
+    }
+    dst->rowLookup[base + moved] = row;
+    dst->numRows64++;
+    if (dst->numRows < UINT32_MAX) {
+      dst->numRows++;
+    }
+  }
+  if (moved > 0) {
+    if (base == 0) {
+      dst->firstRow = src->firstRow;
+    } else {
+      dst->rowLookup[base - 1]->next = src->rowLookup[0];
+    }
+    dst->rowLookup[base + moved - 1]->next = nullptr;
+  }
+  bool dropped = (moved < src->numRows64);
+  if (dropped) {
+    // The rest of src is dropped, its rows are freed here
+    for (uint32_t d = 0; d < dst->nDicts; d++) {
+      if (dst->dicts[d].nCodes > base + moved) {
+        dst->dicts[d].nCodes = (uint32_t)(base + moved);
+      }
+    }
+    for (uint64_t r = moved; r < src->numRows64; r++) {
+      freeRow(src, src->rowLookup[r]);
+    }
+  }
+  if (src->numCols > dst->numCols) {
+    dst->numCols = src->numCols;
+  }
+  for (uint32_t e = 0; e < src->nErrors; e++) {
+    addError(dst, src->errors[e].kind, base + src->errors[e].row,
+             src->errors[e].byteOffset);
+  }
+  dst->errorCount += src->errorCount - src->nErrors;
+  CsvStats *to = &dst->stats;
+  const CsvStats *from = &src->stats;
+  to->bytesRead += from->bytesRead;
+  to->rows += from->rows;
+  to->cells += from->cells;
+  to->multiLineRecords += from->multiLineRecords;
+  to->malformedQuotes += from->malformedQuotes;
+  to->allocCount += from->allocCount;
+  to->allocBytes += from->allocBytes;
+  to->ioNs += from->ioNs;
+  to->scanNs += from->scanNs;
+  to->materializeNs += from->materializeNs;
+  to->indexNs += from->indexNs;
+  to->invalidUtf8Cells += from->invalidUtf8Cells;
+  to->badUtf16Units += from->badUtf16Units;
+  if (dropped) {
+    addError(dst, csvErrorOutOfMemory, dst->numRows64, 0);
+  }
+  dst->outOfMemory = dst->outOfMemory || src->outOfMemory;
+  freeDicts(src);
+  csvFree(src, src->errors);
+  csvFree(src, src->rowLookup);
+  freeCsv(src);
+}
+
+// Does this chunk end its file? Under csvStrict any error does,
+// running out of memory always does.
+static bool endsFile(CsvType *chunk, const CsvOptions *opts) {
+  return chunk->outOfMemory ||
+         (opts->errorPolicy == csvStrict && chunk->errorCount > 0);
+}
+
+// Put the chunks of a split file back together. The chunks after one
+// that ends the file are dropped.
+static void stitchFile(FileLoad *load, const CsvOptions *opts) {
+  if (load->nChunks == 0) {
+    return;
+  }
+  load->csv = load->chunks[0];
+  bool stopped = (load->csv == nullptr || endsFile(load->csv, opts));
+  for (uint32_t c = 1; c < load->nChunks; c++) {
+    if (stopped) {
+      freeMem(load->chunks[c]);
+      continue;
+    }
+    if (load->chunks[c] == nullptr) {
+      // There was no memory to start this chunk
+      load->csv->outOfMemory = true;
+      addError(load->csv, csvErrorOutOfMemory, load->csv->numRows64,
+               load->index.starts[load->chunkStarts[c]]);
+      stopped = true;
+      continue;
+    }
+    stopped = endsFile(load->chunks[c], opts);
+    appendCsv(load->csv, load->chunks[c]);
+    stopped = stopped || load->csv->outOfMemory;
+  }
+  free(load->chunks);
+  free(load->chunkStarts);
+  free(load->index.starts);
+}
+
+// Load every file, on nThreads threads (0 for one per CPU)
+static FileLoad *loadMany(const char *const *paths, uint32_t n,
+                          const CsvOptions *opts, uint32_t nThreads) {
+  FileLoad *files = (FileLoad *)calloc(n + 1, sizeof(FileLoad));
+  LoadPool *pool = (LoadPool *)calloc(1, sizeof(LoadPool));
+  if (files == nullptr || pool == nullptr) {
+    free(files);
+    free(pool);
+    return nullptr;
+  }
+  if (nThreads == 0) {
+    long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nThreads = (nCpus > 0) ? (uint32_t)nCpus : 1;
+  }
+  nThreads = (nThreads > MAXTHREADS) ? MAXTHREADS : nThreads;
+  pool->files = files;
+  pool->opts = opts;
+  pool->nThreads = nThreads;
+  for (uint32_t t = 0; t < nThreads; t++) {
+    pthread_mutex_init(&pool->deques[t].lock, nullptr);
+  }
+  for (uint32_t f = 0; f < n; f++) {
+    files[f].path = paths[f];
+    LoadTask task = {f, WHOLEFILE};
+    if (!pushTask(pool, f % nThreads, task)) {
+      runTask(pool, f % nThreads, task);
+    }
+  }
+  LoadWorker workers[MAXTHREADS];
+  pthread_t threads[MAXTHREADS];
+  bool started[MAXTHREADS];
+  for (uint32_t t = 0; t < nThreads; t++) {
+    workers[t].pool = pool;
+    workers[t].id = t;
+    started[t] = (t > 0 && pthread_create(&threads[t], nullptr,
+                                          loadWorkerMain, &workers[t]) == 0);
+  }
+  // The calling thread is worker 0, and steals from any that did not start
+  loadWorkerMain(&workers[0]);
+  for (uint32_t t = 1; t < nThreads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], nullptr);
+    }
+  }
+  for (uint32_t t = 0; t < nThreads; t++) {
+    pthread_mutex_destroy(&pool->deques[t].lock);
+    free(pool->deques[t].tasks);
+  }
+  free(pool);
+  for (uint32_t f = 0; f < n; f++) {
+    stitchFile(&files[f], opts);
+  }
+  return files;
+}
+
+CsvType **readCsvManyOptions(const char *const *paths, uint32_t n,
+                             const CsvOptions *opts, uint32_t nThreads) {
+  FileLoad *files = loadMany(paths, n, opts, nThreads);
+  if (files == nullptr) {
+    return nullptr;
+  }
+  CsvType **csvs = (CsvType **)malloc((n + 1) * sizeof(CsvType *));
+  for (uint32_t f = 0; f < n; f++) {
+    if (csvs != nullptr) {
+      csvs[f] = files[f].csv;
+    } else {
+      freeMem(files[f].csv);
+    }
+  }
+  free(files);
+  return csvs;
+}
+
+CsvType **readCsvMany(const char *const *paths, uint32_t n, char sep,
+                      uint32_t nThreads) {
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.dialect.separator = sep;
+  return readCsvManyOptions(paths, n, &opts, nThreads);
+}
+
+CsvType *readCsvManyConcatOptions(const char *const *paths, uint32_t n,
+                                  const CsvOptions *opts, uint32_t nThreads) {
+  FileLoad *files = loadMany(paths, n, opts, nThreads);
+  if (files == nullptr) {
+    return nullptr;
+  }
+  CsvType *csv = (n > 0) ? files[0].csv : newCsv(opts);
+  for (uint32_t f = 1; f < n; f++) {
+    if (csv == nullptr || csv->outOfMemory) {
+      // The files after one that ran out of memory are dropped
+      freeMem(files[f].csv);
+    } else {
+      appendCsv(csv, files[f].csv);
+    }
+  }
+  free(files);
+  return csv;
+}
+
+CsvType *readCsvManyConcat(const char *const *paths, uint32_t n, char sep,
+                           uint32_t nThreads) {
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.dialect.separator = sep;
+  return readCsvManyConcatOptions(paths, n, &opts, nThreads);
+}
+
+void freeCsvMany(CsvType **csvs, uint32_t n) {
+  if (csvs == nullptr) {
+    return;
+  }
+  for (uint32_t f = 0; f < n; f++) {
+    freeMem(csvs[f]);
+  }
+  free(csvs);
+}
+
+////////////////////////////////////////////////////
+// Arrow export through the C Data Interface.
+// Each column is typed and its buffers filled on its own thread,
+// reading the cells straight from the csv, so nothing but the Arrow
+// buffers is allocated. Every array owns its buffers and frees them
+// in its release callback, so nothing points back into the csv.
+////////////////////////////////////////////////////
+typedef struct ArrowExport {
+  CsvType *csv;
+  uint64_t firstRow;
+  uint64_t nRows;
+  uint32_t nCols;
+  bool inferTypes;
+  struct ArrowArray **arrays;
+  const char **formats;
+  bool failed;
+} ArrowExport;
+
+// The cell of col in exported row r, false if the row is too short
+static bool arrowCell(const ArrowExport *ex, uint64_t r, uint32_t col,
+                      CsvCellView *view) {
+  CsvCellType cell = getCell64(ex->csv, ex->firstRow + r, col);
+  view->contents = (cell.status == normalCell) ? cell.cellContents : nullptr;
+  view->bytes = (view->contents != nullptr) ? cell.bytes : 0;
+  view->flags = cell.flags;
+  return cell.status == normalCell || cell.status == emptyCell;
+}
+
+static CsvCellType viewCell(const CsvCellView *view) {
+  CsvCellType cell;
+  cell.bytes = view->bytes;
+  cell.status = view->contents ? normalCell : emptyCell;
+  cell.lastCellInRow = false;
+  cell.flags = view->flags;
+  cell.cellContents = (char *)view->contents;
+  return cell;
+}
+
+// A cell's text without quotes, false if it is too long for a number
+static bool arrowNumberText(const CsvCellView *view, char *text,
+                            uint32_t size) {
+  if (view->bytes >= size) {
+    return false;
+  }
+  CsvCellType cell = viewCell(view);
+  csvUnescapeCell(&cell, text, size);
+  return text[0] != '\0';
+}
+
+static bool parseInt64Text(const char *text, int64_t *value) {
+  bool negative = (*text == '-');
+  if (*text == '-' || *text == '+') {
+    text++;
+  }
+  if (*text == '\0') {
+    return false;
+  }
+  uint64_t magnitude = 0;
+  for (; *text != '\0'; text++) {
+    if (*text < '0' || *text > '9' || magnitude > UINT64_MAX / 10 - 1) {
+      return false;
+    }
+    magnitude = magnitude * 10 + (uint64_t)(*text - '0');
+  }
+  if (magnitude > (uint64_t)INT64_MAX + (negative ? 1 : 0)) {
+    return false;
+  }
+  *value = negative ? -(int64_t)(magnitude - 1) - 1 : (int64_t)magnitude;
+  return true;
+}
+
+// A plain decimal number: [+-] digits [. digits] [e [+-] digits], with
+// digits on at least one side of the point
+static bool plainDecimal(const char *text) {
+  if (*text == '+' || *text == '-') {
+    text++;
+  }
+  uint32_t digits = 0;
+  for (; *text >= '0' && *text <= '9'; text++) {
+    digits++;
+  }
+  if (*text == '.') {
+    for (text++; *text >= '0' && *text <= '9'; text++) {
+      digits++;
+    }
+  }
+  if (digits == 0) {
+    return false;
+  }
+  if (*text == 'e' || *text == 'E') {
+    text++;
+    if (*text == '+' || *text == '-') {
+      text++;
+    }
+    if (*text < '0' || *text > '9') {
+      return false;
+    }
+    while (*text >= '0' && *text <= '9') {
+      text++;
+    }
+  }
+  return *text == '\0';
+}
+
+static bool parseFloat64Text(const char *text, double *value) {
+  // strtod() also skips spaces and reads hex, inf and nan, csv numbers
+  // are plainer. Out of range values stay text rather than become inf.
+  if (!plainDecimal(text)) {
+    return false;
+  }
+  errno = 0;
+  *value = strtod(text, nullptr);
+  return errno != ERANGE;
+}
+
+// Plain digits short enough that they can not overflow an int64_t
+static inline bool shortDigits(const CsvCellView *view) {
+  return (view->flags & CSV_CELL_DIGITS) && view->bytes <= 18;
+}
+
+static int64_t digitsValue(const CsvCellView *view) {
+  int64_t value = 0;
+  for (uint32_t i = 0; i < view->bytes; i++) {
+    value = value * 10 + (int64_t)(view->contents[i] - '0');
+  }
+  return value;
+}
+
+static void releaseArrowArray(struct ArrowArray *array) {
+  for (int64_t c = 0; c < array->n_children; c++) {
+    if (array->children[c]->release != nullptr) {
+      array->children[c]->release(array->children[c]);
+    }
+    free(array->children[c]);
+  }
+  free(array->children);
+  for (int64_t b = 0; b < array->n_buffers; b++) {
+    free((void *)array->buffers[b]);
+  }
+  free((void *)array->buffers);
+  array->release = nullptr;
+}
+
+static void releaseArrowSchema(struct ArrowSchema *schema) {
+  for (int64_t c = 0; c < schema->n_children; c++) {
+    if (schema->children[c]->release != nullptr) {
+      schema->children[c]->release(schema->children[c]);
+    }
+    free(schema->children[c]);
+  }
+  free(schema->children);
+  free((void *)schema->name);
+  schema->release = nullptr;
+}
+
+////////////////////////////////////////////////////
+// Type one column and fill its buffers. With inferTypes the column is
+// int64 until a cell is not an integer, then float64 until one is not
+// a number. A column with no values at all stays utf8.
+////////////////////////////////////////////////////
+static bool exportArrowColumn(ArrowExport *ex, uint32_t col) {
+  uint64_t n = ex->nRows;
+  bool isInt = ex->inferTypes;
+  bool isFloat = ex->inferTypes;
+  bool anyValue = false;
+  uint64_t textBytes = 0;
+  char text[64];
+  CsvCellView cellView;
+  const CsvCellView *view = &cellView;
+  for (uint64_t r = 0; r < n; r++) {
+    if (!arrowCell(ex, r, col, &cellView)) {
+      continue;
+    }
+    textBytes += view->bytes;
+    if (!(isInt || isFloat) || view->contents == nullptr ||
+        shortDigits(view)) {
+      anyValue = anyValue || view->contents != nullptr;
+      continue;
+    }
+    anyValue = true;
+    int64_t intValue;
+    double floatValue;
+    if (!arrowNumberText(view, text, sizeof(text))) {
+      isInt = false;
+      isFloat = false;
+    } else if (isInt && !parseInt64Text(text, &intValue)) {
+      isInt = false;
+    }
+    if (!isInt && isFloat && !parseFloat64Text(text, &floatValue)) {
+      isFloat = false;
+    }
+  }
+  if (!anyValue) {
+    isInt = false;
+    isFloat = false;
+  }
+  bool isNumber = isInt || isFloat;
+  bool large = textBytes > INT32_MAX;
+
+  struct ArrowArray *array =
+      (struct ArrowArray *)malloc(sizeof(struct ArrowArray));
+  const void **buffers = (const void **)calloc(3, sizeof(void *));
+  uint8_t *valid = (uint8_t *)calloc(n / 8 + 1, 1);
+  void *values = nullptr;
+  char *data = nullptr;
+  if (isNumber) {
+    values = malloc((n + 1) * sizeof(int64_t));
+  } else {
+    values = malloc((n + 1) * (large ? sizeof(int64_t) : sizeof(int32_t)));
+    data = (char *)malloc(textBytes + 1);
+  }
+  if (array == nullptr || buffers == nullptr || valid == nullptr ||
+      values == nullptr || (!isNumber && data == nullptr)) {
+    free(array);
+    free((void *)buffers);
+    free(valid);
+    free(values);
+    free(data);
+    return false;
+  }
+
+  int64_t nullCount = 0;
+  uint64_t dataBytes = 0;
+  for (uint64_t r = 0; r < n; r++) {
+    bool present = arrowCell(ex, r, col, &cellView);
+    if (isNumber) {
+      int64_t intValue = 0;
+      double floatValue = 0.0;
+      bool isValid = present && view->contents != nullptr;
+      if (isValid && isInt) {
+        if (shortDigits(view)) {
+          intValue = digitsValue(view);
+        } else {
+          arrowNumberText(view, text, sizeof(text));
+          parseInt64Text(text, &intValue);
+        }
+        ((int64_t *)values)[r] = intValue;
+      } else if (isValid) {
+        if (shortDigits(view)) {
+          floatValue = (double)digitsValue(view);
+        } else {
+          arrowNumberText(view, text, sizeof(text));
+          parseFloat64Text(text, &floatValue);
+        }
+        ((double *)values)[r] = floatValue;
+      } else {
+        ((int64_t *)values)[r] = 0;
+      }
+      present = isValid;
+    } else {
+      if (present && view->contents != nullptr) {
+        if (view->flags & CSV_CELL_QUOTED) {
+          CsvCellType cell = viewCell(view);
+          dataBytes += csvUnescapeCell(&cell, &data[dataBytes], view->bytes + 1);
+        } else {
+          memcpy(&data[dataBytes], view->contents, view->bytes);
+          dataBytes += view->bytes;
+        }
+      }
+      if (large) {
+        ((int64_t *)values)[r + 1] = (int64_t)dataBytes;
+      } else {
+        ((int32_t *)values)[r + 1] = (int32_t)dataBytes;
+      }
+    }
+    if (present) {
+      valid[r / 8] |= (uint8_t)(1 << (r % 8));
+    } else {
+      nullCount++;
+    }
+  }
+  if (!isNumber) {
+    if (large) {
+      ((int64_t *)values)[0] = 0;
+    } else {
+      ((int32_t *)values)[0] = 0;
+    }
+  }
+  // No bitmap is needed when every slot is valid
+  if (nullCount == 0) {
+    free(valid);
+    valid = nullptr;
+  }
+  buffers[0] = valid;
+  buffers[1] = values;
+  buffers[2] = data;
+  array->length = (int64_t)n;
+  array->null_count = nullCount;
+  array->offset = 0;
+  array->n_buffers = isNumber ? 2 : 3;
+  array->n_children = 0;
+  array->buffers = buffers;
+  array->children = nullptr;
+  array->dictionary = nullptr;
+  array->release = releaseArrowArray;
+  array->private_data = nullptr;
+  ex->arrays[col] = array;
+  if (isNumber) {
+    ex->formats[col] = isInt ? "l" : "g";
+  } else {
+    ex->formats[col] = large ? "U" : "u";
+  }
+  return true;
+}
+
+static void exportArrowColumns(void *arg, uint64_t first, uint64_t last) {
+  ArrowExport *ex = (ArrowExport *)arg;
+  for (uint64_t c = first; c < last; c++) {
+    if (!exportArrowColumn(ex, (uint32_t)c)) {
+      __atomic_store_n(&ex->failed, true, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// The header cell without quotes, or f0, f1 ... if there is none
+static char *arrowFieldName(const CsvCellView *view, uint32_t col) {
+  uint32_t bytes = (view != nullptr && view->contents) ? view->bytes : 0;
+  char *name = (char *)malloc(bytes > 0 ? bytes + 1 : 16);
+  if (name == nullptr) {
+    return nullptr;
+  }
+  if (bytes > 0) {
+    CsvCellType cell = viewCell(view);
+    csvUnescapeCell(&cell, name, bytes + 1);
+  } else {
+    snprintf(name, 16, "f%u", col);
+  }
+  return name;
+}
+
+static bool buildArrowSchema(ArrowExport *ex, bool headerRow,
+                             struct ArrowSchema *schema) {
+  uint32_t nCols = ex->nCols;
+  memset((void *)schema, 0, sizeof(*schema));
+  schema->format = "+s";
+  schema->name = (char *)calloc(1, 1);
+  schema->children =
+      (struct ArrowSchema **)calloc(nCols + 1, sizeof(struct ArrowSchema *));
+  schema->release = releaseArrowSchema;
+  if (schema->name == nullptr || schema->children == nullptr) {
+    return false;
+  }
+  CsvRowCursor cursor = csvRowCursor64(ex->csv, 0);
+  CsvCellView view;
+  bool haveNames = headerRow;
+  for (uint32_t c = 0; c < nCols; c++) {
+    haveNames = haveNames && csvRowNext(&cursor, &view);
+    struct ArrowSchema *child =
+        (struct ArrowSchema *)calloc(1, sizeof(struct ArrowSchema));
+    if (child == nullptr) {
+      return false;
+    }
+    schema->children[schema->n_children++] = child;
+    child->format = ex->formats[c];
+    child->name = arrowFieldName(haveNames ? &view : nullptr, c);
+    child->flags = ARROW_FLAG_NULLABLE;
+    child->release = releaseArrowSchema;
+    if (child->name == nullptr) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool csvToArrow(CsvType *csv, bool headerRow, bool inferTypes,
+                struct ArrowSchema *schema, struct ArrowArray *array) {
+  schema->release = nullptr;
+  array->release = nullptr;
+  if (csv == nullptr) {
+    return false;
+  }
+  ArrowExport ex;
+  memset((void *)&ex, 0, sizeof(ex));
+  ex.csv = csv;
+  ex.firstRow = (headerRow && csv->numRows64 > 0) ? 1 : 0;
+  ex.nRows = csv->numRows64 - ex.firstRow;
+  ex.nCols = csv->numCols;
+  ex.inferTypes = inferTypes;
+  ex.arrays = (struct ArrowArray **)calloc(ex.nCols + 1,
+                                           sizeof(struct ArrowArray *));
+  ex.formats = (const char **)calloc(ex.nCols + 1, sizeof(char *));
+  const void **buffers = (const void **)calloc(1, sizeof(void *));
+  bool ok = (ex.arrays != nullptr && ex.formats != nullptr &&
+             buffers != nullptr);
+  if (ok) {
+    uint32_t nThreads = numThreadsFor(ex.nRows * ex.nCols);
+    if (nThreads > ex.nCols) {
+      nThreads = ex.nCols;
+    }
+    parallelForThreads(ex.nCols, nThreads, exportArrowColumns, &ex);
+    ok = !ex.failed;
+  }
+  if (ok && !buildArrowSchema(&ex, headerRow, schema)) {
+    releaseArrowSchema(schema);
+    ok = false;
+  }
+  free((void *)ex.formats);
+  if (ok) {
+    // The batch itself is a struct array with no nulls of its own
+    array->length = (int64_t)ex.nRows;
+    array->null_count = 0;
+    array->offset = 0;
+    array->n_buffers = 1;
+    array->n_children = ex.nCols;
+    array->buffers = buffers;
+    array->children = ex.arrays;
+    array->dictionary = nullptr;
+    array->release = releaseArrowArray;
+    array->private_data = nullptr;
+    return true;
+  }
+  for (uint32_t c = 0; ex.arrays != nullptr && c < ex.nCols; c++) {
+    if (ex.arrays[c] != nullptr) {
+      releaseArrowArray(ex.arrays[c]);
+      free(ex.arrays[c]);
+    }
+  }
+  free(ex.arrays);
+  free((void *)buffers);
+  return false;
+}
+
+#ifdef __cplusplus
+CsvClass::CsvClass() { csv = nullptr; }
+//////////////////////////
+CsvClass::~CsvClass() {
+  if (csv != nullptr) {
+    freeMem(csv);
+  }
+}
+
+//////////////////////////
+CsvClass::CsvClass(CsvClass &&other) noexcept {
+  csv = other.csv;
+  other.csv = nullptr;
+}
+
+//////////////////////////
+CsvClass &CsvClass::operator=(CsvClass &&other) noexcept {
+  if (this != &other) {
+    freeMem(csv);
+    csv = other.csv;
+    other.csv = nullptr;
+  }
+  return *this;
+}
+
+//////////////////////////
+uint32_t CsvClass::NumRows() {
+  uint32_t count = 0;
+  if (csv != nullptr) {
+    count = csv->numRows;
+  }
+  return count;
+}
+
+//////////////////////////
+uint32_t CsvClass::NumCols() {
+  uint32_t count = 0;
+  if (csv != nullptr) {
+    count = csv->numCols;
+  }
+  return count;
+}
+//////////////////////////
+bool CsvClass::ReadCsv(const char *filename, char sep) {
+  bool result = false;
+  // Reading again replaces the previous file
+  freeMem(csv);
+  csv = readCsv(filename, sep);
+  if (csv != nullptr) {
+    result = true;
+  }
+  return (result);
+}
+
+//////////////////////////
+CsvStats CsvClass::Stats() { return csvGetStats(csv); }
+
 //////////////////////////
 CsvCellType CsvClass::GetCell(uint32_t row, uint32_t col) {
   CsvCellType cell = {};
@@ -479,4 +4154,85 @@ CsvCellType CsvClass::GetCell(uint32_t row, uint32_t col) {
   }
   return (cell);
 }
+
+//////////////////////////
+// CsvDocument
+//////////////////////////
+CsvDocument::CsvDocument(const char *filename, char separator) {
+  csv = readCsv(filename, separator);
+}
+
+//////////////////////////
+CsvDocument::CsvDocument(const char *filename, const CsvOptions &opts) {
+  csv = readCsvOptions(filename, &opts);
+}
+
+//////////////////////////
+CsvDocument::~CsvDocument() { freeMem(csv); }
+
+//////////////////////////
+CsvDocument CsvDocument::OpenSnapshot(const char *path) {
+  CsvDocument doc;
+  doc.csv = csvOpenSnapshot(path);
+  return doc;
+}
+
+//////////////////////////
+CsvDocument &CsvDocument::operator=(CsvDocument &&other) noexcept {
+  if (this != &other) {
+    freeMem(csv);
+    csv = other.csv;
+    other.csv = nullptr;
+  }
+  return *this;
+}
+
+//////////////////////////
+std::string_view CsvDocument::cell(std::size_t row, std::size_t col) const {
+  CsvCellType found = getCell64(csv, (uint64_t)row, (uint32_t)col);
+  if (found.status != normalCell) {
+    return std::string_view();
+  }
+  return std::string_view(found.cellContents, found.bytes);
+}
+
+std::string CsvDocument::unescaped(std::size_t row, std::size_t col) const {
+  CsvCellType found = getCell64(csv, (uint64_t)row, (uint32_t)col);
+  if (found.status != normalCell) {
+    return std::string();
+  }
+  std::string text(found.bytes + 1, '\0');
+  uint32_t len = csvUnescapeCell(&found, &text[0], (uint32_t)text.size());
+  text.resize(len);
+  return text;
+}
+
+//////////////////////////
+std::size_t CsvDocument::Row::size() const {
+  std::size_t count = 0;
+  CsvRowCursor cursor = csvRowCursor64(csv, row);
+  CsvCellView view;
+  while (csvRowNext(&cursor, &view)) {
+    count++;
+  }
+  return count;
+}
+
+//////////////////////////
+std::string_view CsvDocument::Row::operator[](std::size_t col) const {
+  CsvCellType found = getCell64(csv, row, (uint32_t)col);
+  if (found.status != normalCell) {
+    return std::string_view();
+  }
+  return std::string_view(found.cellContents, found.bytes);
+}
+
+//////////////////////////
+std::string_view CsvDocument::Column::operator[](std::size_t row) const {
+  CsvCellType found = getCell64(csv, (uint64_t)row, col);
+  if (found.status != normalCell) {
+    return std::string_view();
+  }
+  return std::string_view(found.cellContents, found.bytes);
+}
 #endif
@@ -10,6 +10,7 @@ Copyright (c) 2024 Chris McGowan
 */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 //////////////////////////////////////
@@ -40,18 +41,252 @@ typedef struct CsvCellType {
   uint32_t bytes;
   CellStatusType status;
   bool lastCellInRow;
+  uint8_t flags; // CSV_CELL_... bits, found while parsing
   char *cellContents;
 } CsvCellType;
 
+////////////////////////////////////////
+// What the parser saw in a cell. cellContents is the raw text, so
+// these say when it needs decoding without looking at it again.
+////////////////////////////////////////
+#define CSV_CELL_QUOTED 0x01         // starts with the quote character
+#define CSV_CELL_ESCAPED_QUOTES 0x02 // quoted, with "" inside
+#define CSV_CELL_NEWLINE 0x04        // a newline inside quotes
+#define CSV_CELL_SEPARATOR 0x08      // a separator inside quotes
+#define CSV_CELL_SMART_QUOTED 0x10   // has excel's 8 bit quotes
+#define CSV_CELL_DIGITS 0x20         // only ASCII 0-9 (never set when trimming)
+#define CSV_CELL_INVALID_UTF8 0x40   // not valid UTF-8 (only if validating)
+
 typedef struct RowType RowType; // Defined in the c file
+typedef struct CsvHashIndex CsvHashIndex; // Defined in the c file
+typedef struct CsvDict CsvDict; // Defined in the c file
+typedef struct CsvHandle CsvHandle; // Defined in the c file
+
+////////////////////////////////////////
+// What a load did, filled in by every readCsv.
+// The timings are in nanoseconds. Reading the clock once per block
+// (rather than per line or cell) keeps the cost negligible.
+////////////////////////////////////////
+typedef struct CsvStats {
+  uint64_t bytesRead;
+  uint64_t rows;
+  uint64_t cells;
+  uint64_t multiLineRecords; // records with newlines inside quotes
+  uint64_t malformedQuotes;  // records cut short by unbalanced quotes
+  uint64_t allocCount;       // mallocs (and reallocs) for the tree
+  uint64_t allocBytes;
+  uint64_t ioNs;          // reading the file
+  uint64_t scanNs;        // finding the records in what was read
+  uint64_t materializeNs; // splitting records into cells
+  uint64_t indexNs;       // growing rowLookup
+  uint64_t invalidUtf8Cells; // cells with CSV_CELL_INVALID_UTF8
+  uint64_t badUtf16Units;    // UTF-16 that could not be transcoded
+} CsvStats;
+
+////////////////////////////////////////
+// Problems found in the input. A load keeps the first few of them in
+// its error log, see csvGetErrors().
+////////////////////////////////////////
+typedef enum CsvErrorKind {
+  csvErrorUnreadable = 1,        // the file could not be opened
+  csvErrorRunawayQuote = 2,      // a quote still open 224K bytes later
+  csvErrorUnterminatedQuote = 3, // the file ended inside quotes
+  csvErrorInvalidUtf8 = 4,       // only when validating UTF-8
+  csvErrorOutOfMemory = 5        // the allocator failed, the load stopped
+} CsvErrorKind;
+
+typedef struct CsvError {
+  uint64_t row;        // the row the record was, or would have been
+  uint64_t byteOffset; // where the record starts in the file
+  CsvErrorKind kind;
+} CsvError;
+
+// What a load does with a record that has an error
+typedef enum CsvErrorPolicy {
+  csvBestEffort = 0, // keep what can be made of it
+  csvSkipRecord = 1, // drop the bad line and carry on from the next one
+  csvStrict = 2      // stop loading, keeping the rows before it
+} CsvErrorPolicy;
+
+#define CSV_DEFAULT_MAX_ERRORS 100
+
+////////////////////////////////////////
+// Where the memory of a csv tree comes from. ctx is passed back on
+// every call. alloc and realloc return nullptr when there is no more,
+// and the load stops with a csvErrorOutOfMemory error. All three
+// nullptr means malloc, realloc and free.
+////////////////////////////////////////
+typedef struct CsvAllocator {
+  void *(*alloc)(void *ctx, size_t bytes);
+  void *(*realloc)(void *ctx, void *ptr, size_t bytes);
+  void (*free)(void *ctx, void *ptr);
+  void *ctx;
+} CsvAllocator;
 
 typedef struct CsvType {
   RowType **rowLookup;
   uint32_t numRows;
   uint32_t numCols;
   RowType *firstRow;
+  // Dictionaries of the encoded columns
+  CsvDict *dicts;
+  uint32_t nDicts;
+  CsvStats stats;
+  // Room in rowLookup, it grows as rows are parsed
+  uint32_t rowCapacity;
+  // Set if this csv is a mapped snapshot file rather than a tree
+  const char *snapshot;
+  uint64_t snapshotBytes;
+  // The error log, the first maxErrors of errorCount errors
+  CsvError *errors;
+  uint32_t nErrors;
+  uint32_t maxErrors;
+  uint64_t errorCount;
+  // The row count without the 32 bit limit. numRows and rowCapacity
+  // stop at UINT32_MAX, these are the real numbers
+  uint64_t numRows64;
+  uint64_t rowCapacity64;
+  // The tree is allocated from here and freed back to it
+  CsvAllocator allocator;
+  bool outOfMemory;
 } CsvType;
 
+// The code of a row that has no cell in a dictionary encoded column
+#define CSV_NO_CODE 0xFFFFFFFFu
+
+// A cell's text without a copy. contents is nullptr for an empty cell
+typedef struct CsvCellView {
+  const char *contents;
+  uint32_t bytes;
+  uint8_t flags; // CSV_CELL_... bits
+} CsvCellView;
+
+// Where a walk along the cells of a row is up to
+typedef struct CsvRowCursor {
+  CsvType *csv;
+  const void *cell;
+  uint32_t remaining; // cells left, for snapshots
+} CsvRowCursor;
+
+// A reader's hold on the current version of a CsvHandle
+typedef struct CsvHandleRef {
+  CsvType *csv;
+  uint32_t epoch;
+} CsvHandleRef;
+
+typedef enum CsvSortType {
+  csvSortString = 0, // byte order
+  // strtod() value of the whole cell, without quotes. Cells that are
+  // not numbers go last, descending too
+  csvSortNumeric = 1
+} CsvSortType;
+
+typedef struct CsvSortKey {
+  uint32_t col;
+  CsvSortType type;
+  bool descending;
+} CsvSortKey;
+
+////////////////////////////////////////
+// How the file is written. The defaults (csvDefaultOptions) are
+// comma separated, " quotes, with excel's smart quotes and DOS CR-LF
+// line ends understood.
+// Loads pick a loop compiled for just the features they need; the
+// plain comma, no smart quote, LF case has its own.
+////////////////////////////////////////
+typedef struct CsvDialect {
+  char separator;
+  char quote;       // quotes cells that contain separators or newlines
+  bool smartQuotes; // excel's 8 bit start and end double quotes
+  bool crlf;        // a CR also ends a cell
+  bool trim;        // drop spaces and tabs around each cell
+} CsvDialect;
+
+// How the file is encoded. Cells are always UTF-8 (or whatever 8 bit
+// encoding the file uses). UTF-16 files are transcoded as they are read.
+typedef enum CsvEncoding {
+  csvEncodingAuto = 0, // from the byte order mark, UTF-8 if there is none
+  csvEncodingUtf8 = 1,
+  csvEncodingUtf16LE = 2,
+  csvEncodingUtf16BE = 3
+} CsvEncoding;
+
+typedef struct CsvOptions {
+  CsvDialect dialect;
+  CsvEncoding encoding;
+  // Check every cell is valid UTF-8, setting CSV_CELL_INVALID_UTF8 on
+  // those that are not. Rows that are all ASCII cost almost nothing.
+  bool validateUtf8;
+  CsvErrorPolicy errorPolicy;
+  uint32_t maxErrors; // kept in the error log, CSV_DEFAULT_MAX_ERRORS
+  // For tests: the file is read blockBytes at a time (0 for 1 MB), and
+  // genericParser turns off the specialised comma separated loop
+  uint32_t blockBytes;
+  bool genericParser;
+  // Columns to dictionary encode. Every distinct value is stored once
+  // and the cells of the column share it, which saves a lot of memory
+  // for columns that repeat a few values (country, status ...)
+  const uint32_t *dictCols;
+  uint32_t nDictCols;
+  // Memory for the rows, cells and dictionaries, see CsvAllocator.
+  // It must be safe to call from several threads at once for
+  // readCsvMany() and freeMemParallel().
+  CsvAllocator allocator;
+} CsvOptions;
+
+// A matching pair of rows from csvJoin()
+typedef struct CsvRowPair {
+  uint32_t leftRow;
+  uint32_t rightRow;
+} CsvRowPair;
+
+//////////////////////////////////////
+// The Apache Arrow C Data Interface, as given in the Arrow spec.
+// Arrow's own headers define the same structs behind the same guard,
+// so either may be included first.
+//////////////////////////////////////
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  // Array type description
+  const char *format;
+  const char *name;
+  const char *metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema **children;
+  struct ArrowSchema *dictionary;
+
+  // Release callback
+  void (*release)(struct ArrowSchema *);
+  // Opaque producer-specific data
+  void *private_data;
+};
+
+struct ArrowArray {
+  // Array data description
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void **buffers;
+  struct ArrowArray **children;
+  struct ArrowArray *dictionary;
+
+  // Release callback
+  void (*release)(struct ArrowArray *);
+  // Opaque producer-specific data
+  void *private_data;
+};
+
+#endif // ARROW_C_DATA_INTERFACE
+
 ////////////////////////
 // Functions
 ////////////////////////
@@ -62,39 +297,489 @@ extern "C" {
 ///////////////////////////////////////////////////////
 // Read the csv file into memory
 ///////////////////////////////////////////////////////
-CsvType *readCsv(char *filename, char seperator);
+CsvType *readCsv(const char *filename, char seperator);
+
+///////////////////////////////////////////////////////
+// Read the csv file with options.
+// Start from csvDefaultOptions() and change what you need.
+// These reads return nullptr only if there is no memory for an empty
+// csv. Running out later keeps the rows before it, see CsvAllocator.
+///////////////////////////////////////////////////////
+void csvDefaultOptions(CsvOptions *opts);
+CsvType *readCsvOptions(const char *filename, const CsvOptions *opts);
+
+///////////////////////////////////////////////////////
+// Read only some rows of a large file. Row numbers count every
+// record in the file from 0, including any header line.
+// readCsvRange() reads count rows from firstRow on. readCsvSample()
+// keeps each row with probability fraction, the same rows for the
+// same seed. Rows that are not wanted are only scanned for where
+// they end, never split into cells.
+// csvBuildRowIndex() writes filename.csvidx, which lets both of these
+// seek close to the rows they want instead of scanning from the
+// start. It is ignored once the csv file changes.
+///////////////////////////////////////////////////////
+CsvType *readCsvRange(const char *filename, uint64_t firstRow, uint32_t count);
+CsvType *readCsvRangeOptions(const char *filename, uint64_t firstRow,
+                             uint32_t count, const CsvOptions *opts);
+CsvType *readCsvSample(const char *filename, double fraction, uint64_t seed);
+CsvType *readCsvSampleOptions(const char *filename, double fraction,
+                              uint64_t seed, const CsvOptions *opts);
+bool csvBuildRowIndex(const char *filename, const CsvOptions *opts);
+
+///////////////////////////////////////////////////////
+// Read many files on nThreads threads (0 for one per CPU).
+// Threads that run out of files take chunks of the big ones, so one
+// large file does not hold up the rest.
+// readCsvMany() returns a malloc'ed array of n csvs in the order of
+// paths, free it with freeCsvMany(). A file that can not be read gets
+// an empty csv with a csvErrorUnreadable error, one there was no
+// memory to start is nullptr.
+// readCsvManyConcat() returns one csv with the rows of every file, in
+// order. Header lines are kept as rows like any other.
+///////////////////////////////////////////////////////
+CsvType **readCsvMany(const char *const *paths, uint32_t n, char sep,
+                      uint32_t nThreads);
+CsvType **readCsvManyOptions(const char *const *paths, uint32_t n,
+                             const CsvOptions *opts, uint32_t nThreads);
+CsvType *readCsvManyConcat(const char *const *paths, uint32_t n, char sep,
+                           uint32_t nThreads);
+CsvType *readCsvManyConcatOptions(const char *const *paths, uint32_t n,
+                                  const CsvOptions *opts, uint32_t nThreads);
+void freeCsvMany(CsvType **csvs, uint32_t n);
 
 ///////////////////////////////////////////////////////
 // Get the cell value at row,col
 ///////////////////////////////////////////////////////
 CsvCellType getCell(CsvType *csv, uint32_t row, uint32_t col);
 
+///////////////////////////////////////////////////////
+// Copy a cell's text to out without its enclosing quotes, with
+// doubled quotes made single. At most outSize - 1 bytes are copied
+// and out is always nul terminated. Returns the length of the whole
+// decoded text, which may be more than was copied.
+///////////////////////////////////////////////////////
+uint32_t csvUnescapeCell(const CsvCellType *cell, char *out, uint32_t outSize);
+
 uint32_t numRows(CsvType *csv);
 uint32_t numCols(CsvType *csv);
 
+///////////////////////////////////////////////////////
+// 64 bit row numbers, for files of more than 4 billion rows.
+// numRows() stops at UINT32_MAX and getCell() and csvRowCursor()
+// can only reach the rows below it. Each record is still limited to
+// 4GB. Sorting, hash indexes and dictionary codes use 32 bit row ids
+// and fail (false or nullptr) on a csv with more rows than that.
+///////////////////////////////////////////////////////
+uint64_t numRows64(CsvType *csv);
+CsvCellType getCell64(CsvType *csv, uint64_t row, uint32_t col);
+CsvRowCursor csvRowCursor64(CsvType *csv, uint64_t row);
+
+///////////////////////////////////////////////////////
+// Walk the cells of a row in order, without copying them or
+// starting from the first cell every time:
+//   CsvRowCursor cursor = csvRowCursor(csv, row);
+//   CsvCellView view;
+//   while (csvRowNext(&cursor, &view)) { ... }
+///////////////////////////////////////////////////////
+CsvRowCursor csvRowCursor(CsvType *csv, uint32_t row);
+bool csvRowNext(CsvRowCursor *cursor, CsvCellView *view);
+
+///////////////////////////////////////////////////////
+// Bulk reads. Fills out with the cells of up to nRows rows from
+// firstRow on, in order, stopping early at the last row or when the
+// next row's cells would not fit in maxCells. The cells of row
+// firstRow + r are out[rowStarts[r]] .. out[rowStarts[r + 1] - 1],
+// so rowStarts needs room for nRows + 1 entries. Returns the number
+// of rows filled. With maxCells >= numCols() every call fills at
+// least one row.
+//   for (uint64_t row = 0; row < numRows64(csv); row += got) {
+//     got = csvGetRowBatch(csv, row, 256, views, 256 * nCols, starts);
+//     ...
+//   }
+///////////////////////////////////////////////////////
+uint32_t csvGetRowBatch(CsvType *csv, uint64_t firstRow, uint32_t nRows,
+                        CsvCellView *out, uint32_t maxCells,
+                        uint32_t *rowStarts);
+
+///////////////////////////////////////////////////////
+// Counters and timings of the load
+///////////////////////////////////////////////////////
+CsvStats csvGetStats(CsvType *csv);
+
+///////////////////////////////////////////////////////
+// The errors found while loading, in file order. Only the first
+// opts.maxErrors are kept, *totalErrors (if not nullptr) says how
+// many there were. Nothing is printed for them.
+///////////////////////////////////////////////////////
+const CsvError *csvGetErrors(CsvType *csv, uint32_t *nErrors,
+                             uint64_t *totalErrors);
+
 ///////////////////////////////////////////////////////
 // free up memory used in the csv tree
 ///////////////////////////////////////////////////////
 void freeMem(CsvType *csv);
 
+///////////////////////////////////////////////////////
+// Faster ways to free a big csv tree.
+// freeMemParallel() frees ranges of rows on several threads.
+// freeMemAsync() hands the tree to a background thread and returns
+// straight away; csv must not be used after the call.
+// csvWaitForFrees() waits until the background frees are done.
+///////////////////////////////////////////////////////
+void freeMemParallel(CsvType *csv);
+void freeMemAsync(CsvType *csv);
+void csvWaitForFrees(void);
+
+///////////////////////////////////////////////////////
+// Dictionary encoded columns.
+// csvColumnCodes() gives the code of every row (nCodes == numRows),
+// handy for fast group by and equality tests. Equal values have equal
+// codes. Returns nullptr if col was not encoded.
+// csvDictString() gives the value of a code.
+///////////////////////////////////////////////////////
+const uint32_t *csvColumnCodes(CsvType *csv, uint32_t col, uint32_t *nCodes);
+uint32_t csvDictSize(CsvType *csv, uint32_t col);
+const char *csvDictString(CsvType *csv, uint32_t col, uint32_t code);
+
+///////////////////////////////////////////////////////
+// Snapshots.
+// csvSaveSnapshot() writes the parsed csv to a binary file.
+// csvOpenSnapshot() maps such a file read only: it opens much faster
+// than a load, and processes on the same host that open the same file
+// share one copy of it. getCell() and friends work as usual, free it
+// with freeMem(). A snapshot can not be sorted or dictionary
+// encoded, and its cellContents must not be written to.
+// The file is in the byte order of the machine that wrote it.
+// Failures print nothing: csvSaveSnapshot() returns false and
+// csvOpenSnapshot() nullptr, as it does for a damaged file.
+///////////////////////////////////////////////////////
+bool csvSaveSnapshot(CsvType *csv, const char *path);
+CsvType *csvOpenSnapshot(const char *path);
+
+///////////////////////////////////////////////////////
+// Hot reloading for long running programs.
+// A CsvHandle holds the current version of a file. csvHandleReload()
+// loads the file again on a background thread and swaps the new
+// version in when it is complete. Readers never wait or lock:
+//   CsvHandleRef ref = csvHandleAcquire(handle);
+//   CsvCellType cell = getCell(ref.csv, row, col);
+//   csvHandleRelease(handle, ref);
+// An old version is freed once every reader holding it has released
+// it, so keep hold of a ref only briefly.
+// opts may be nullptr for the defaults.
+///////////////////////////////////////////////////////
+CsvHandle *csvHandleOpen(const char *filename, const CsvOptions *opts);
+bool csvHandleReload(CsvHandle *handle);
+bool csvHandleWaitReload(CsvHandle *handle);
+CsvHandleRef csvHandleAcquire(CsvHandle *handle);
+void csvHandleRelease(CsvHandle *handle, CsvHandleRef ref);
+uint64_t csvHandleVersion(CsvHandle *handle);
+void csvHandleClose(CsvHandle *handle);
+
+///////////////////////////////////////////////////////
+// Sort the rows by keys[0], then keys[1] ... The sort is stable.
+// Only the row order changes, the cells are not moved, and row
+// numbers (getCell, csvColumnCodes) and the row list from firstRow
+// follow the new order. A hash index built before the sort holds the
+// old row numbers, free it and build it again.
+// Returns false if it ran out of memory, leaving csv unchanged.
+///////////////////////////////////////////////////////
+bool csvSortRows(CsvType *csv, const CsvSortKey *keys, uint32_t nKeys);
+
+///////////////////////////////////////////////////////
+// Hash index on one column, for lookups and joins between csv files.
+// Built in parallel. The index points into the csv tree, so
+// free the index before the tree. csvSortRows() makes it out of date.
+///////////////////////////////////////////////////////
+CsvHashIndex *csvBuildHashIndex(CsvType *csv, uint32_t keyCol);
+void csvFreeHashIndex(CsvHashIndex *index);
+
+///////////////////////////////////////////////////////
+// Rows whose key equals key. Fills up to maxRowIds sorted row ids and
+// returns the total number of matches.
+///////////////////////////////////////////////////////
+uint32_t csvLookup(CsvHashIndex *index, const char *key, uint32_t *rowIds,
+                   uint32_t maxRowIds);
+
+///////////////////////////////////////////////////////
+// Inner join of left.leftCol with the indexed column of another csv.
+// Returns a malloc'ed array of *nPairs row pairs, free() it when done.
+// A join with no matches returns an array with *nPairs 0. nullptr
+// means it failed: no memory, or left has too many rows for 32 bit
+// row ids.
+///////////////////////////////////////////////////////
+CsvRowPair *csvJoin(CsvType *left, uint32_t leftCol, CsvHashIndex *rightIndex,
+                    uint64_t *nPairs);
+
+///////////////////////////////////////////////////////
+// Export the csv as an Arrow record batch: a struct array ("+s") with
+// a child array per column, built in parallel, one column per thread.
+// With headerRow, row 0 names the columns and is not exported.
+// With inferTypes, a column whose cells are all integers is int64
+// ("l"), all numbers is float64 ("g"), otherwise utf8 ("u", or "U"
+// over 2GB of text). Strings have their quotes removed. Empty cells
+// are null in number columns, cells missing from short rows are
+// null in all columns.
+// The buffers are the caller's until it calls the release callbacks,
+// the csv can be freed first. Returns false if out of memory.
+///////////////////////////////////////////////////////
+bool csvToArrow(CsvType *csv, bool headerRow, bool inferTypes,
+                struct ArrowSchema *schema, struct ArrowArray *array);
+
 #ifdef __cplusplus
 }
 #endif
 // For C++ only
 // Class difinitions
 #ifdef __cplusplus
+#include <charconv>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
 class CsvClass {
 public:
   CsvClass();
   ~CsvClass();
+  CsvClass(const CsvClass &) = delete;
+  CsvClass &operator=(const CsvClass &) = delete;
+  CsvClass(CsvClass &&other) noexcept;
+  CsvClass &operator=(CsvClass &&other) noexcept;
   uint32_t NumRows();
   uint32_t NumCols();
-  bool ReadCsv(char *filename, char seperator);
+  bool ReadCsv(const char *filename, char seperator);
   CsvCellType GetCell(uint32_t row, uint32_t col);
+  CsvStats Stats();
 
 private:
   CsvType *csv;
 };
+
+//////////////////////////////////////
+// CsvDocument owns a parsed csv file (C++17).
+// Cells are std::string_view's into the parsed tree, so reading them
+// costs no copies or heap allocations. Move only.
+//
+//   CsvDocument doc("example.csv");
+//   for (auto row : doc) {
+//     for (std::string_view cell : row) { ... }
+//   }
+//   double price = doc.get<double>(1, 3);
+//////////////////////////////////////
+class CsvDocument {
+public:
+  // The cells of one row, for range-for
+  class Row {
+  public:
+    class iterator {
+    public:
+      using iterator_category = std::input_iterator_tag;
+      using value_type = std::string_view;
+      using difference_type = std::ptrdiff_t;
+      using pointer = const std::string_view *;
+      using reference = std::string_view;
+
+      iterator() : cursor{nullptr, nullptr, 0}, done(true) {}
+      explicit iterator(CsvRowCursor start) : cursor(start), done(false) {
+        ++*this;
+      }
+      std::string_view operator*() const { return text; }
+      iterator &operator++() {
+        CsvCellView view;
+        done = !csvRowNext(&cursor, &view);
+        text = done ? std::string_view()
+                    : std::string_view(view.contents ? view.contents : "",
+                                       view.bytes);
+        return *this;
+      }
+      bool operator==(const iterator &other) const {
+        return done == other.done && (done || cursor.cell == other.cursor.cell);
+      }
+      bool operator!=(const iterator &other) const { return !(*this == other); }
+
+    private:
+      CsvRowCursor cursor;
+      std::string_view text;
+      bool done;
+    };
+
+    Row(CsvType *csv, uint64_t row) : csv(csv), row(row) {}
+    iterator begin() const { return iterator(csvRowCursor64(csv, row)); }
+    iterator end() const { return iterator(); }
+    std::size_t size() const;
+    std::string_view operator[](std::size_t col) const;
+    uint64_t index() const { return row; }
+
+  private:
+    CsvType *csv;
+    uint64_t row;
+  };
+
+  // One column, as a span-like view down the rows.
+  // Rows too short to have the column give an empty string_view.
+  class Column {
+  public:
+    class iterator {
+    public:
+      using iterator_category = std::random_access_iterator_tag;
+      using value_type = std::string_view;
+      using difference_type = std::ptrdiff_t;
+      using pointer = const std::string_view *;
+      using reference = std::string_view;
+
+      iterator(const Column *column, std::size_t row)
+          : column(column), row(row) {}
+      std::string_view operator*() const { return (*column)[row]; }
+      iterator &operator++() {
+        ++row;
+        return *this;
+      }
+      difference_type operator-(const iterator &other) const {
+        return (difference_type)row - (difference_type)other.row;
+      }
+      bool operator==(const iterator &other) const { return row == other.row; }
+      bool operator!=(const iterator &other) const { return row != other.row; }
+
+    private:
+      const Column *column;
+      std::size_t row;
+    };
+
+    Column(CsvType *csv, uint32_t col) : csv(csv), col(col) {}
+    std::size_t size() const { return csv ? (std::size_t)numRows64(csv) : 0; }
+    bool empty() const { return size() == 0; }
+    std::string_view operator[](std::size_t row) const;
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, size()); }
+
+  private:
+    CsvType *csv;
+    uint32_t col;
+  };
+
+  // Rows of the document, for range-for
+  class iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Row;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const Row *;
+    using reference = Row;
+
+    iterator(CsvType *csv, uint64_t row) : csv(csv), row(row) {}
+    Row operator*() const { return Row(csv, row); }
+    iterator &operator++() {
+      ++row;
+      return *this;
+    }
+    bool operator==(const iterator &other) const { return row == other.row; }
+    bool operator!=(const iterator &other) const { return row != other.row; }
+
+  private:
+    CsvType *csv;
+    uint64_t row;
+  };
+
+  CsvDocument() = default;
+  explicit CsvDocument(const char *filename, char separator = ',');
+  CsvDocument(const char *filename, const CsvOptions &opts);
+  ~CsvDocument();
+  CsvDocument(const CsvDocument &) = delete;
+  CsvDocument &operator=(const CsvDocument &) = delete;
+  CsvDocument(CsvDocument &&other) noexcept : csv(other.csv) {
+    other.csv = nullptr;
+  }
+  CsvDocument &operator=(CsvDocument &&other) noexcept;
+
+  // Map a file written by csvSaveSnapshot()
+  static CsvDocument OpenSnapshot(const char *path);
+
+  explicit operator bool() const { return csv != nullptr; }
+  std::size_t rows() const { return csv ? (std::size_t)numRows64(csv) : 0; }
+  std::size_t cols() const { return csv ? numCols(csv) : 0; }
+  CsvStats stats() const { return csvGetStats(csv); }
+
+  // Empty if the cell is empty or missing
+  std::string_view cell(std::size_t row, std::size_t col) const;
+  Row row(std::size_t row) const { return Row(csv, (uint64_t)row); }
+  Row operator[](std::size_t row) const { return Row(csv, (uint64_t)row); }
+  Column column(std::size_t col) const { return Column(csv, (uint32_t)col); }
+  iterator begin() const { return iterator(csv, 0); }
+  iterator end() const { return iterator(csv, (uint64_t)rows()); }
+
+  // The underlying C tree, still owned by the document
+  CsvType *handle() const { return csv; }
+
+  // The cell without enclosing quotes and with "" made "
+  std::string unescaped(std::size_t row, std::size_t col) const;
+
+  ///////////////////////////////////////
+  // Convert a cell. Numbers may be in double quotes.
+  // Returns fallback if the cell is missing or does not convert.
+  ///////////////////////////////////////
+  template <typename T> T get(std::size_t row, std::size_t col,
+                              T fallback = T()) const {
+    CsvCellType found = getCell64(csv, (uint64_t)row, (uint32_t)col);
+    std::string_view text;
+    if (found.status == normalCell) {
+      text = std::string_view(found.cellContents, found.bytes);
+    }
+    if constexpr (std::is_same_v<T, std::string_view>) {
+      return text.empty() ? fallback : text;
+    } else if constexpr (std::is_same_v<T, std::string>) {
+      return text.empty() ? fallback : std::string(text);
+    } else if constexpr (std::is_same_v<T, bool>) {
+      text = unquote(text);
+      if (text == "1" || text == "true" || text == "TRUE" || text == "True") {
+        return true;
+      }
+      if (text == "0" || text == "false" || text == "FALSE" ||
+          text == "False") {
+        return false;
+      }
+      return fallback;
+    } else if constexpr (std::is_arithmetic_v<T>) {
+      // Plain digits that can not overflow a uint64_t need no parsing
+      if constexpr (std::is_integral_v<T>) {
+        if ((found.flags & CSV_CELL_DIGITS) && !text.empty() &&
+            text.size() <= 19) {
+          uint64_t value = 0;
+          for (char ch : text) {
+            value = value * 10 + (uint64_t)(ch - '0');
+          }
+          if (value > (uint64_t)std::numeric_limits<T>::max()) {
+            return fallback;
+          }
+          return (T)value;
+        }
+      }
+      text = unquote(text);
+      T value;
+      const char *last = text.data() + text.size();
+      std::from_chars_result result = std::from_chars(text.data(), last, value);
+      if (text.empty() || result.ec != std::errc() || result.ptr != last) {
+        return fallback;
+      }
+      return value;
+    } else {
+      static_assert(!std::is_same_v<T, T>, "CsvDocument::get<T>: unsupported T");
+    }
+  }
+
+private:
+  static std::string_view unquote(std::string_view text) {
+    if (text.size() >= 2 && text.front() == '"' && text.back() == '"') {
+      return text.substr(1, text.size() - 2);
+    }
+    return text;
+  }
+
+  CsvType *csv = nullptr;
+};
 #endif
 
 #endif
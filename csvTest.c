@@ -1,5 +1,6 @@
 #include "csvParser.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 int main(int argc, char **argv) {
@@ -11,32 +12,31 @@ int main(int argc, char **argv) {
   uint32_t nRows = csv->numRows;
   uint32_t nCols = csv->numCols;
   fprintf(stderr, "Rows %u max columns %u\n", nRows, nCols);
-  for (uint32_t r = 0; r < nRows; r++) {
-    for (uint32_t c = 0; c < nCols; c++) {
-      CsvCellType cell = getCell(csv, r, c);
-      switch (cell.status) {
-      case missingRow:
-      case missingCol:
-        break;
-      case emptyCell:
-        if (cell.lastCellInRow == false)
-          printf(",");
-        break;
-      case normalCell:
-        if (cell.bytes == 0) {
-          printf("->Zero bytes for a normal Cell<-");
+  // Read the cells a block of rows at a time
+  uint32_t batchRows = 256;
+  uint32_t maxCells = batchRows * (nCols > 0 ? nCols : 1);
+  CsvCellView *views = (CsvCellView *)malloc(maxCells * sizeof(CsvCellView));
+  uint32_t *rowStarts = (uint32_t *)malloc((batchRows + 1) * sizeof(uint32_t));
+  if (views == NULL || rowStarts == NULL) {
+    return 1;
+  }
+  uint32_t got = 0;
+  for (uint32_t r = 0; r < nRows; r += got) {
+    got = csvGetRowBatch(csv, r, batchRows, views, maxCells, rowStarts);
+    for (uint32_t b = 0; b < got; b++) {
+      for (uint32_t c = rowStarts[b]; c < rowStarts[b + 1]; c++) {
+        // An empty cell has no contents
+        if (views[c].contents != NULL) {
+          printf("%s", views[c].contents);
         }
-        printf("%s", cell.cellContents);
-        if (cell.lastCellInRow == false)
+        if (c + 1 < rowStarts[b + 1])
           printf(",");
-        break;
-      default:
-        printf("->WTF? %d <-", (int)cell.status);
-        break;
       }
+      printf("\n");
     }
-    printf("\n");
   }
+  free(views);
+  free(rowStarts);
   // sleep(1);
   freeMem(csv);
 }
@@ -0,0 +1,767 @@
+/***************************************
+MIT License
+See LICENCE at https://github.com/ChrisMcGowanAu/csvParser
+Copyright (c) 2024 Chris McGowan
+***************************************/
+
+////////////////////////////////////////////////////
+// Differential tests.
+// Every way the library has of loading a file must give the same
+// getCell() results as the plain parseLine() loop. Each input is
+// loaded by all of them and compared cell by cell.
+//
+//   csvDiffTest file.csv ...            compare on these files
+//   csvDiffTest --generate 500 --seed 1 compare on generated files
+//   csvDiffTest --perf 20 [base drop]   fail below 20 MB/s, or below
+//                                       base MB/s less drop (0.2 = 20%)
+//   csvDiffTest --large                 ranges of a file of more than
+//                                       4GB and 2^32 records
+//
+// Built with -DCSV_FUZZER it is a libFuzzer target instead, which
+// runs the same comparison on every input the fuzzer makes.
+////////////////////////////////////////////////////
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "csvParser.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static char tempDir[256] = "/tmp";
+
+////////////////////////////////////////////////////
+// The ways of loading a file. Each returns a csv to compare with the
+// reference, which is the generic parser on 1 MB blocks.
+////////////////////////////////////////////////////
+static CsvType *loadReference(const char *path) {
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.genericParser = true;
+  return readCsvOptions(path, &opts);
+}
+
+static CsvType *loadDefault(const char *path) { return readCsv(path, ','); }
+
+// Records cross block boundaries all the time
+static CsvType *loadSmallBlocks(const char *path) {
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.blockBytes = 8;
+  return readCsvOptions(path, &opts);
+}
+
+static CsvType *loadOddBlocks(const char *path) {
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.blockBytes = 61;
+  return readCsvOptions(path, &opts);
+}
+
+static CsvType *loadValidated(const char *path) {
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.validateUtf8 = true;
+  return readCsvOptions(path, &opts);
+}
+
+static CsvType *loadSnapshot(const char *path) {
+  char snapPath[512];
+  snprintf(snapPath, sizeof(snapPath), "%s.snap", path);
+  CsvType *tree = readCsv(path, ',');
+  bool saved = csvSaveSnapshot(tree, snapPath);
+  freeMem(tree);
+  CsvType *csv = saved ? csvOpenSnapshot(snapPath) : nullptr;
+  // The mapping outlives the file
+  remove(snapPath);
+  return csv;
+}
+
+static CsvType *loadRange(const char *path) {
+  return readCsvRange(path, 0, UINT32_MAX);
+}
+
+static CsvType *loadSample(const char *path) {
+  return readCsvSample(path, 1.0, 1);
+}
+
+static CsvType *loadSorted(const char *path) {
+  // Sorting on a column every row lacks leaves the order alone
+  CsvType *csv = readCsv(path, ',');
+  CsvSortKey key;
+  key.col = numCols(csv) + 1;
+  key.type = csvSortString;
+  key.descending = false;
+  csvSortRows(csv, &key, 1);
+  return csv;
+}
+
+// Chunks of the file are loaded on other threads and stitched
+static CsvType *loadMany(const char *path) {
+  CsvType **csvs = readCsvMany(&path, 1, ',', 4);
+  CsvType *csv = csvs[0];
+  free(csvs);
+  return csv;
+}
+
+typedef struct Engine {
+  const char *name;
+  CsvType *(*load)(const char *path);
+  uint8_t ignoreFlags; // flags that this engine may set differently
+} Engine;
+
+static const Engine engines[] = {
+    {"default", loadDefault, 0},
+    {"blocks of 8", loadSmallBlocks, 0},
+    {"blocks of 61", loadOddBlocks, 0},
+    {"validated", loadValidated, CSV_CELL_INVALID_UTF8},
+    {"snapshot", loadSnapshot, 0},
+    {"range", loadRange, 0},
+    {"sample", loadSample, 0},
+    {"sorted", loadSorted, 0},
+    {"many", loadMany, 0},
+};
+#define NENGINES (sizeof(engines) / sizeof(engines[0]))
+
+////////////////////////////////////////////////////
+// Compare rows [csvFirst, csvFirst + nRows) of csv with rows
+// [firstRow, ...) of ref
+////////////////////////////////////////////////////
+static bool sameRows(CsvType *ref, uint32_t firstRow, CsvType *csv,
+                     uint32_t csvFirst, uint32_t nRows, uint8_t ignoreFlags,
+                     const char *name, const char *path) {
+  uint32_t cols = numCols(ref) + 1;
+  for (uint32_t r = 0; r < nRows; r++) {
+    for (uint32_t c = 0; c < cols; c++) {
+      CsvCellType want = getCell(ref, firstRow + r, c);
+      CsvCellType got = getCell(csv, csvFirst + r, c);
+      bool same = (want.status == got.status);
+      if (same && want.status != missingCol && want.status != missingRow) {
+        same = want.bytes == got.bytes &&
+               want.lastCellInRow == got.lastCellInRow &&
+               (want.flags & ~ignoreFlags) == (got.flags & ~ignoreFlags) &&
+               (want.bytes == 0 ||
+                memcmp(want.cellContents, got.cellContents, want.bytes) == 0);
+      }
+      if (!same) {
+        fprintf(stderr, "%s: %s differs at row %u col %u\n", path, name,
+                firstRow + r, c);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// csvGetRowBatch() must give the cells getCell() does, in small
+// batches that often stop early for want of room
+static bool sameBatches(CsvType *csv, const char *name, const char *path) {
+  uint32_t maxCells = 2 * numCols(csv) + 1;
+  CsvCellView *views = (CsvCellView *)malloc(maxCells * sizeof(CsvCellView));
+  uint32_t rowStarts[8];
+  uint32_t got = 0;
+  bool ok = (views != nullptr);
+  for (uint32_t r = 0; ok && r < numRows(csv); r += got) {
+    got = csvGetRowBatch(csv, r, 7, views, maxCells, rowStarts);
+    ok = (got > 0);
+    for (uint32_t b = 0; ok && b < got; b++) {
+      uint32_t n = rowStarts[b + 1] - rowStarts[b];
+      ok = (getCell(csv, r + b, n).status != normalCell &&
+            getCell(csv, r + b, n).status != emptyCell);
+      for (uint32_t c = 0; ok && c < n; c++) {
+        CsvCellType cell = getCell(csv, r + b, c);
+        const CsvCellView *view = &views[rowStarts[b] + c];
+        ok = view->bytes == cell.bytes && view->flags == cell.flags &&
+             view->contents == (cell.bytes ? cell.cellContents : nullptr);
+      }
+    }
+    if (!ok) {
+      fprintf(stderr, "%s: %s batch differs from row %u\n", path, name, r);
+    }
+  }
+  free(views);
+  return ok;
+}
+
+static bool sameCsv(CsvType *ref, CsvType *csv, uint8_t ignoreFlags,
+                    const char *name, const char *path) {
+  if (csv == nullptr) {
+    fprintf(stderr, "%s: %s did not load\n", path, name);
+    return false;
+  }
+  if (numRows(csv) != numRows(ref) || numCols(csv) != numCols(ref)) {
+    fprintf(stderr, "%s: %s has %u x %u cells, not %u x %u\n", path, name,
+            numRows(csv), numCols(csv), numRows(ref), numCols(ref));
+    return false;
+  }
+  return sameRows(ref, 0, csv, 0, numRows(ref), ignoreFlags, name, path) &&
+         sameBatches(csv, name, path);
+}
+
+// Load the file in pieces through a row index
+static bool sameRangesIndexed(CsvType *ref, const char *path) {
+  if (!csvBuildRowIndex(path, nullptr)) {
+    fprintf(stderr, "%s: no row index\n", path);
+    return false;
+  }
+  bool ok = true;
+  uint32_t piece = 3 + numRows(ref) / 4;
+  for (uint32_t first = 0; ok && first <= numRows(ref); first += piece) {
+    CsvType *csv = readCsvRange(path, first, piece);
+    uint32_t want = numRows(ref) - first < piece ? numRows(ref) - first : piece;
+    if (numRows(csv) != want) {
+      fprintf(stderr, "%s: indexed range at %u has %u rows, not %u\n", path,
+              first, numRows(csv), want);
+      ok = false;
+    } else {
+      ok = sameRows(ref, first, csv, 0, want, 0, "indexed range", path);
+    }
+    freeMem(csv);
+  }
+  char indexPath[512];
+  snprintf(indexPath, sizeof(indexPath), "%s.csvidx", path);
+  remove(indexPath);
+  return ok;
+}
+
+static bool sameThroughHandle(CsvType *ref, const char *path) {
+  CsvHandle *handle = csvHandleOpen(path, nullptr);
+  if (handle == nullptr) {
+    fprintf(stderr, "%s: handle did not open\n", path);
+    return false;
+  }
+  bool ok = csvHandleReload(handle) && csvHandleWaitReload(handle);
+  CsvHandleRef ref2 = csvHandleAcquire(handle);
+  ok = ok && sameCsv(ref, ref2.csv, 0, "handle", path);
+  csvHandleRelease(handle, ref2);
+  csvHandleClose(handle);
+  return ok;
+}
+
+// Every value of an Arrow export must be the cell it came from
+static bool sameArrowCell(CsvType *ref, uint32_t row, uint32_t col,
+                          const char *format, struct ArrowArray *array) {
+  CsvCellType want = getCell(ref, row, col);
+  const uint8_t *valid = (const uint8_t *)array->buffers[0];
+  bool isValid = valid == nullptr || (valid[row / 8] >> (row % 8)) & 1;
+  char text[4096];
+  uint32_t len = csvUnescapeCell(&want, text, sizeof(text));
+  if (want.status == missingCol || want.status == missingRow ||
+      (format[0] != 'u' && want.status == emptyCell)) {
+    return !isValid;
+  }
+  if (!isValid || len >= sizeof(text)) {
+    return isValid;
+  }
+  if (format[0] == 'l') {
+    return ((const int64_t *)array->buffers[1])[row] ==
+           strtoll(text, nullptr, 10);
+  }
+  if (format[0] == 'g') {
+    // Only plain decimals, no hex, inf, nan or overflow to inf
+    double value = strtod(text, nullptr);
+    return strspn(text, "+-.0123456789eE") == len && isfinite(value) &&
+           ((const double *)array->buffers[1])[row] == value;
+  }
+  const int32_t *offsets = (const int32_t *)array->buffers[1];
+  const char *data = (const char *)array->buffers[2];
+  return (uint32_t)(offsets[row + 1] - offsets[row]) == len &&
+         memcmp(&data[offsets[row]], text, len) == 0;
+}
+
+static bool sameArrow(CsvType *ref, const char *path) {
+  struct ArrowSchema schema;
+  struct ArrowArray array;
+  if (!csvToArrow(ref, false, true, &schema, &array)) {
+    fprintf(stderr, "%s: no arrow export\n", path);
+    return false;
+  }
+  bool ok = array.length == numRows(ref) && array.n_children == numCols(ref) &&
+            schema.n_children == numCols(ref);
+  for (uint32_t c = 0; ok && c < numCols(ref); c++) {
+    for (uint32_t r = 0; ok && r < numRows(ref); r++) {
+      ok = sameArrowCell(ref, r, c, schema.children[c]->format,
+                         array.children[c]);
+      if (!ok) {
+        fprintf(stderr, "%s: arrow differs at row %u col %u\n", path, r, c);
+      }
+    }
+  }
+  array.release(&array);
+  schema.release(&schema);
+  return ok;
+}
+
+// Three copies of the file in one csv, with a dictionary column
+static bool sameConcatenated(CsvType *ref, const char *path) {
+  const char *paths[3] = {path, path, path};
+  uint32_t dictCol = 1;
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.dictCols = &dictCol;
+  opts.nDictCols = 1;
+  CsvType *csv = readCsvManyConcatOptions(paths, 3, &opts, 4);
+  uint32_t n = numRows(ref);
+  bool ok = (numRows(csv) == 3 * n && numCols(csv) == numCols(ref));
+  if (!ok) {
+    fprintf(stderr, "%s: concatenated has %u rows, not %u\n", path,
+            numRows(csv), 3 * n);
+  }
+  uint32_t nCodes = 0;
+  const uint32_t *codes = csvColumnCodes(csv, dictCol, &nCodes);
+  for (uint32_t f = 0; ok && f < 3; f++) {
+    ok = sameRows(ref, 0, csv, f * n, n, 0, "concatenated", path);
+  }
+  for (uint32_t r = 0; ok && r < nCodes; r++) {
+    CsvCellType cell = getCell(csv, r, dictCol);
+    ok = (codes[r] == CSV_NO_CODE) == (cell.status == missingCol);
+    if (ok && codes[r] != CSV_NO_CODE) {
+      const char *text = csvDictString(csv, dictCol, codes[r]);
+      ok = (cell.bytes == 0 && text[0] == '\0') || cell.cellContents == text;
+    }
+    if (!ok) {
+      fprintf(stderr, "%s: concatenated code differs at row %u\n", path, r);
+    }
+  }
+  ok = ok && nCodes == 3 * n;
+  freeMem(csv);
+  return ok;
+}
+
+////////////////////////////////////////////////////
+// An allocator that fails every call after the first budget of them,
+// and counts the blocks held so that leaks and double frees show.
+// Safe on several threads for readCsvMany().
+////////////////////////////////////////////////////
+typedef struct TestHeap {
+  uint64_t budget;
+  uint64_t calls;
+  int64_t live;
+} TestHeap;
+
+static void *testAlloc(void *ctx, size_t bytes) {
+  TestHeap *heap = (TestHeap *)ctx;
+  if (__atomic_add_fetch(&heap->calls, 1, __ATOMIC_SEQ_CST) > heap->budget) {
+    return nullptr;
+  }
+  void *ptr = malloc(bytes);
+  if (ptr != nullptr) {
+    __atomic_add_fetch(&heap->live, 1, __ATOMIC_SEQ_CST);
+  }
+  return ptr;
+}
+
+static void *testRealloc(void *ctx, void *ptr, size_t bytes) {
+  if (ptr == nullptr) {
+    return testAlloc(ctx, bytes);
+  }
+  TestHeap *heap = (TestHeap *)ctx;
+  if (__atomic_add_fetch(&heap->calls, 1, __ATOMIC_SEQ_CST) > heap->budget) {
+    return nullptr;
+  }
+  return realloc(ptr, bytes);
+}
+
+static void testFree(void *ctx, void *ptr) {
+  TestHeap *heap = (TestHeap *)ctx;
+  __atomic_sub_fetch(&heap->live, 1, __ATOMIC_SEQ_CST);
+  free(ptr);
+}
+
+// The rows of a load that ran out of memory must be whole rows from
+// the start of copies of ref
+static bool samePrefix(CsvType *ref, CsvType *csv, const char *name,
+                       const char *path) {
+  uint32_t n = numRows(ref);
+  bool ok = csv->outOfMemory;
+  for (uint32_t r = 0; ok && n > 0 && r < numRows(csv); r += n) {
+    uint32_t count = (numRows(csv) - r < n) ? numRows(csv) - r : n;
+    ok = sameRows(ref, 0, csv, r, count, 0, name, path);
+  }
+  uint32_t nCodes = 0;
+  const uint32_t *codes = csvColumnCodes(csv, 1, &nCodes);
+  ok = ok && (codes == nullptr || nCodes == numRows(csv));
+  if (!ok) {
+    fprintf(stderr, "%s: %s is not the rows before memory ran out\n", path,
+            name);
+  }
+  return ok;
+}
+
+// Loads with an allocator that runs out part way must stop cleanly,
+// keeping whole rows and giving every block back
+static bool sameOutOfMemory(CsvType *ref, const char *path) {
+  const char *paths[3] = {path, path, path};
+  uint32_t dictCol = 1;
+  TestHeap heap = {UINT64_MAX, 0, 0};
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.dictCols = &dictCol;
+  opts.nDictCols = 1;
+  opts.blockBytes = 8;
+  opts.allocator.alloc = testAlloc;
+  opts.allocator.realloc = testRealloc;
+  opts.allocator.free = testFree;
+  opts.allocator.ctx = &heap;
+  CsvType *csv = readCsvOptions(path, &opts);
+  bool ok = sameCsv(ref, csv, 0, "allocator", path) && !csv->outOfMemory;
+  freeMem(csv);
+  uint64_t needed = heap.calls;
+  for (uint64_t budget = 0; ok && budget < needed;
+       budget += needed / 32 + 1) {
+    heap.budget = budget;
+    heap.calls = 0;
+    csv = readCsvOptions(path, &opts);
+    ok = (csv == nullptr || samePrefix(ref, csv, "out of memory", path));
+    freeMem(csv);
+    // The same on threads, stitching chunks and files together
+    heap.calls = 0;
+    csv = readCsvManyConcatOptions(paths, 3, &opts, 4);
+    ok = ok && (csv == nullptr || heap.calls <= budget ||
+                samePrefix(ref, csv, "concatenated out of memory", path));
+    freeMem(csv);
+    if (heap.live != 0) {
+      fprintf(stderr, "%s: %lld blocks not freed after %llu allocations\n",
+              path, (long long)heap.live, (unsigned long long)budget);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+static bool checkFile(const char *path) {
+  CsvType *ref = loadReference(path);
+  bool ok = true;
+  for (uint32_t e = 0; e < NENGINES; e++) {
+    CsvType *csv = engines[e].load(path);
+    ok = sameCsv(ref, csv, engines[e].ignoreFlags, engines[e].name, path) &&
+         ok;
+    freeMem(csv);
+  }
+  ok = sameRangesIndexed(ref, path) && ok;
+  ok = sameThroughHandle(ref, path) && ok;
+  ok = sameArrow(ref, path) && ok;
+  ok = sameConcatenated(ref, path) && ok;
+  ok = sameOutOfMemory(ref, path) && ok;
+  freeMem(ref);
+  return ok;
+}
+
+#ifdef CSV_FUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/csvFuzz.%ld.csv", tempDir, (long)getpid());
+  FILE *fp = fopen(path, "wb");
+  if (fp == nullptr) {
+    return 0;
+  }
+  fwrite(data, 1, size, fp);
+  fclose(fp);
+  if (!checkFile(path)) {
+    abort();
+  }
+  return 0;
+}
+#else
+////////////////////////////////////////////////////
+// Generated input, built from the pieces that have caused trouble:
+// quotes, doubled quotes, separators and newlines inside quotes, CR,
+// excel's quotes, empty cells and a missing final newline.
+////////////////////////////////////////////////////
+static uint64_t rngState;
+
+static uint32_t rnd(uint32_t n) {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 7;
+  rngState ^= rngState << 17;
+  return (uint32_t)(rngState % n);
+}
+
+static const char *pieces[] = {
+    "abc", "12", "0", "-3.5", "", " x ", "\"q\"", "\"a,b\"", "\"say \"\"hi\"\"\"",
+    "\"two\nlines\"", "\"\"", "\xE2\x80\x9Csmart, quoted\xE2\x80\x9D", "caf\xC3\xA9",
+    "\"", "tab\there", "\"cr\r\nlf\"",
+};
+#define NPIECES (sizeof(pieces) / sizeof(pieces[0]))
+
+static void generateFile(const char *path, uint32_t rows) {
+  FILE *fp = fopen(path, "wb");
+  if (fp == nullptr) {
+    perror(path);
+    exit(2);
+  }
+  // Stray quotes and CRs are rarer than the rest
+  uint32_t strayOdds = 1 + rnd(40);
+  bool crlf = rnd(4) == 0;
+  for (uint32_t r = 0; r < rows; r++) {
+    uint32_t cols = rnd(6);
+    if (rnd(10) == 0) {
+      fputc(',', fp);
+    }
+    for (uint32_t c = 0; c < cols; c++) {
+      uint32_t p = rnd(NPIECES);
+      if (strcmp(pieces[p], "\"") == 0 && rnd(strayOdds) != 0) {
+        p = 0;
+      }
+      fputs(pieces[p], fp);
+      if (c + 1 < cols) {
+        fputc(',', fp);
+      }
+    }
+    if (r + 1 < rows || rnd(2) == 0) {
+      fputs(crlf ? "\r\n" : "\n", fp);
+    }
+  }
+  fclose(fp);
+}
+
+static bool checkGenerated(uint32_t count, uint64_t seed) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/csvDiffTest.%ld.csv", tempDir,
+           (long)getpid());
+  uint32_t failed = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    rngState = (seed + i) * 0x9E3779B97F4A7C15ULL + 1;
+    generateFile(path, rnd(80));
+    if (!checkFile(path)) {
+      fprintf(stderr, "generated file %u (seed %llu) differs\n", i,
+              (unsigned long long)seed);
+      failed++;
+    }
+  }
+  remove(path);
+  printf("%u generated files, %u differ\n", count, failed);
+  return failed == 0;
+}
+
+////////////////////////////////////////////////////
+// Load throughput on a generated benchmark file
+////////////////////////////////////////////////////
+static double nowSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static bool checkPerf(double minMBps, double baselineMBps, double maxDrop) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/csvPerf.%ld.csv", tempDir, (long)getpid());
+  FILE *fp = fopen(path, "wb");
+  if (fp == nullptr) {
+    perror(path);
+    return false;
+  }
+  rngState = 12345;
+  for (uint32_t r = 0; r < 200000; r++) {
+    fprintf(fp, "%u,name%u,\"%u, street\",%u.%02u,\"say \"\"%u\"\"\"\n", r,
+            rnd(100000), rnd(1000), rnd(10000), rnd(100), rnd(50));
+  }
+  long bytes = ftell(fp);
+  fclose(fp);
+  double best = 0.0;
+  for (int run = 0; run < 3; run++) {
+    double t0 = nowSeconds();
+    CsvType *csv = readCsv(path, ',');
+    double mbps = (double)bytes / (1024.0 * 1024.0) / (nowSeconds() - t0);
+    freeMem(csv);
+    best = (mbps > best) ? mbps : best;
+  }
+  remove(path);
+  double limit = minMBps;
+  if (baselineMBps > 0.0 && baselineMBps * (1.0 - maxDrop) > limit) {
+    limit = baselineMBps * (1.0 - maxDrop);
+  }
+  printf("readCsv %.1f MB/s, limit %.1f MB/s\n", best, limit);
+  return best >= limit;
+}
+
+////////////////////////////////////////////////////
+// A file of more than 4GB and more than 2^32 records, mostly empty
+// lines, for the 64 bit record numbers, file offsets and row index.
+// Every LARGESTEP'th record is its own number, and one record past
+// the 4GB mark is not UTF-8. Only ranges of it are loaded, the whole
+// tree would need far more memory than the file.
+////////////////////////////////////////////////////
+#define LARGESTEP 65536
+#define LARGERECORDS ((1ULL << 32) + 4 * LARGESTEP)
+#define LARGEBAD ((1ULL << 32) + LARGESTEP + 1)
+
+static bool writeLargeFile(const char *path, uint64_t *badOffset) {
+  FILE *fp = fopen(path, "wb");
+  if (fp == nullptr) {
+    perror(path);
+    return false;
+  }
+  char *chunk = (char *)malloc(LARGESTEP + 32);
+  bool ok = (chunk != nullptr);
+  uint64_t offset = 0;
+  for (uint64_t r = 0; ok && r < LARGERECORDS; r += LARGESTEP) {
+    int len = snprintf(chunk, 32, "%llu\n", (unsigned long long)r);
+    memset(&chunk[len], '\n', LARGESTEP - 1);
+    if (r + LARGESTEP > LARGEBAD && r < LARGEBAD) {
+      // \xff is never valid UTF-8
+      uint64_t bad = len + (LARGEBAD - r - 1);
+      memmove(&chunk[bad + 1], &chunk[bad], LARGESTEP - 1 - (bad - len));
+      chunk[bad] = (char)0xff;
+      *badOffset = offset + bad;
+      len++;
+    }
+    size_t bytes = (size_t)len + LARGESTEP - 1;
+    ok = (fwrite(chunk, 1, bytes, fp) == bytes);
+    offset += bytes;
+  }
+  free(chunk);
+  if (fclose(fp) != 0 || !ok) {
+    perror(path);
+    return false;
+  }
+  return true;
+}
+
+static bool checkLargeRanges(const char *path, uint64_t badOffset,
+                             const char *how) {
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.validateUtf8 = true;
+  bool ok = true;
+  // Records around the bad one, all past 2^32 records and 4GB
+  uint64_t first = LARGEBAD - 1;
+  CsvType *csv = readCsvRangeOptions(path, first, 3, &opts);
+  char want[32];
+  snprintf(want, sizeof(want), "%llu", (unsigned long long)first);
+  CsvCellType cell = getCell64(csv, 0, 0);
+  uint32_t nErrors = 0;
+  const CsvError *errors = csvGetErrors(csv, &nErrors, nullptr);
+  if (csv == nullptr || numRows64(csv) != 3 || cell.status != normalCell ||
+      cell.bytes != strlen(want) || memcmp(cell.cellContents, want, cell.bytes) ||
+      getCell64(csv, 1, 0).status != normalCell ||
+      getCell64(csv, 2, 0).status != missingCol) {
+    fprintf(stderr, "%s: wrong rows from record %llu\n", how,
+            (unsigned long long)first);
+    ok = false;
+  }
+  if (nErrors != 1 || errors[0].kind != csvErrorInvalidUtf8 ||
+      errors[0].row != 1 || errors[0].byteOffset != badOffset) {
+    fprintf(stderr, "%s: bad UTF-8 not found at byte %llu\n", how,
+            (unsigned long long)badOffset);
+    ok = false;
+  }
+  freeMem(csv);
+  // The last rows, and past the end
+  first = LARGERECORDS - LARGESTEP;
+  csv = readCsvRange(path, first, 10);
+  snprintf(want, sizeof(want), "%llu", (unsigned long long)first);
+  cell = getCell64(csv, 0, 0);
+  if (csv == nullptr || numRows64(csv) != 10 || cell.status != normalCell ||
+      cell.bytes != strlen(want) || memcmp(cell.cellContents, want, cell.bytes)) {
+    fprintf(stderr, "%s: wrong rows from record %llu\n", how,
+            (unsigned long long)first);
+    ok = false;
+  }
+  freeMem(csv);
+  csv = readCsvRange(path, LARGERECORDS, 10);
+  if (csv == nullptr || numRows64(csv) != 0) {
+    fprintf(stderr, "%s: rows past the end\n", how);
+    ok = false;
+  }
+  freeMem(csv);
+  printf("large file %s: %s\n", how, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+static bool checkLargeFile(void) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/csvLarge.%ld.csv", tempDir, (long)getpid());
+  char indexPath[600];
+  snprintf(indexPath, sizeof(indexPath), "%s.csvidx", path);
+  uint64_t badOffset = 0;
+  bool ok = writeLargeFile(path, &badOffset);
+  if (ok) {
+    ok = checkLargeRanges(path, badOffset, "scanned");
+  }
+  if (ok && !csvBuildRowIndex(path, nullptr)) {
+    fprintf(stderr, "%s: no row index\n", path);
+    ok = false;
+  }
+  if (ok) {
+    ok = checkLargeRanges(path, badOffset, "indexed");
+  }
+  remove(indexPath);
+  remove(path);
+  return ok;
+}
+
+////////////////////////////////////////////////////
+// The snapshots and row indexes are written next to the file, so each
+// input is checked from a copy of its own in tempDir. The tests never
+// write into the source tree, and runs in parallel do not share files.
+////////////////////////////////////////////////////
+static bool copyToTemp(const char *path, char *copy, size_t copySize) {
+  const char *base = strrchr(path, '/');
+  base = (base != nullptr) ? base + 1 : path;
+  snprintf(copy, copySize, "%s/%ld-%s", tempDir, (long)getpid(), base);
+  FILE *in = fopen(path, "rb");
+  FILE *out = (in != nullptr) ? fopen(copy, "wb") : nullptr;
+  bool ok = (out != nullptr);
+  char block[65536];
+  size_t n;
+  while (ok && in != nullptr && (n = fread(block, 1, sizeof(block), in)) > 0) {
+    ok = (fwrite(block, 1, n, out) == n);
+  }
+  if (in != nullptr) {
+    fclose(in);
+  }
+  if (out != nullptr) {
+    ok = (fclose(out) == 0) && ok;
+  }
+  if (!ok) {
+    fprintf(stderr, "%s: could not copy to %s\n", path, copy);
+    remove(copy);
+  }
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  const char *tmp = getenv("TMPDIR");
+  if (tmp != nullptr && strlen(tmp) < sizeof(tempDir)) {
+    strcpy(tempDir, tmp);
+  }
+  bool ok = true;
+  uint32_t generate = 0;
+  uint64_t seed = 1;
+  for (int a = 1; a < argc; a++) {
+    if (strcmp(argv[a], "--generate") == 0 && a + 1 < argc) {
+      generate = (uint32_t)strtoul(argv[++a], nullptr, 10);
+    } else if (strcmp(argv[a], "--seed") == 0 && a + 1 < argc) {
+      seed = strtoull(argv[++a], nullptr, 10);
+    } else if (strcmp(argv[a], "--perf") == 0 && a + 1 < argc) {
+      double minMBps = atof(argv[++a]);
+      double baseline = 0.0;
+      double drop = 0.0;
+      if (a + 2 < argc && argv[a + 1][0] != '-') {
+        baseline = atof(argv[++a]);
+        drop = atof(argv[++a]);
+      }
+      ok = checkPerf(minMBps, baseline, drop) && ok;
+    } else if (strcmp(argv[a], "--large") == 0) {
+      ok = checkLargeFile() && ok;
+    } else {
+      char copy[512];
+      bool same = copyToTemp(argv[a], copy, sizeof(copy)) && checkFile(copy);
+      remove(copy);
+      printf("%s %s\n", argv[a], same ? "same" : "DIFFERS");
+      ok = same && ok;
+    }
+  }
+  if (generate > 0) {
+    ok = checkGenerated(generate, seed) && ok;
+  }
+  return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,187 @@
+/***************************************
+MIT License
+See LICENCE at https://github.com/ChrisMcGowanAu/csvParser
+Copyright (c) 2024 Chris McGowan
+***************************************/
+
+////////////////////////////////////////////////////
+// Expected results for the C++ classes, CsvDocument and CsvClass,
+// on small files written here.
+//
+//   csvDocumentTest         run every check, exit 1 if any fail
+////////////////////////////////////////////////////
+
+#include "csvParser.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <utility>
+
+static char tempDir[256] = "/tmp";
+static uint32_t failures = 0;
+
+#define EXPECT(cond)                                                           \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond);        \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+// Write text to a file of this process in tempDir, its path in path
+static void writeFile(char *path, size_t pathSize, const char *name,
+                      const char *text) {
+  snprintf(path, pathSize, "%s/csvDocumentTest.%ld.%s", tempDir,
+           (long)getpid(), name);
+  FILE *fp = fopen(path, "wb");
+  if (fp == nullptr) {
+    fprintf(stderr, "Unable to write %s\n", path);
+    exit(1);
+  }
+  fwrite(text, 1, strlen(text), fp);
+  fclose(fp);
+}
+
+static const char *sample = "id,name,price,ok\n"
+                            "1,\"Smith, J\",2.5,true\n"
+                            "2,Lee,\"7\",0\n"
+                            "300,,x\n";
+
+////////////////////////////////////////////////////
+// Cells, conversions and iteration
+////////////////////////////////////////////////////
+static void checkDocument(const char *path) {
+  CsvDocument doc(path);
+  EXPECT((bool)doc);
+  EXPECT(doc.rows() == 4 && doc.cols() == 4);
+  EXPECT(doc.cell(0, 1) == "name");
+  EXPECT(doc.cell(1, 1) == "\"Smith, J\"");
+  EXPECT(doc.unescaped(1, 1) == "Smith, J");
+  EXPECT(doc.cell(3, 1).empty() && doc.cell(3, 3).empty());
+  EXPECT(doc.cell(9, 0).empty());
+
+  EXPECT(doc.get<int>(1, 0) == 1);
+  EXPECT(doc.get<double>(1, 2) == 2.5);
+  EXPECT(doc.get<long>(2, 2) == 7);
+  EXPECT(doc.get<bool>(1, 3) == true);
+  EXPECT(doc.get<bool>(2, 3, true) == false);
+  EXPECT(doc.get<std::string>(2, 1) == "Lee");
+  EXPECT(doc.get<std::string_view>(3, 1, "none") == "none");
+  // Missing, empty, not a number and too big give the fallback
+  EXPECT(doc.get<int>(9, 0, -1) == -1);
+  EXPECT(doc.get<int>(3, 3, -1) == -1);
+  EXPECT(doc.get<int>(3, 1, -1) == -1);
+  EXPECT(doc.get<double>(3, 2, -1.0) == -1.0);
+  EXPECT(doc.get<uint8_t>(3, 0, 7) == 7);
+  EXPECT(doc.get<uint16_t>(3, 0) == 300);
+
+  // Rows and cells in order
+  std::string all;
+  for (auto row : doc) {
+    for (std::string_view cell : row) {
+      all.append(cell);
+      all.push_back('|');
+    }
+    all.push_back('\n');
+  }
+  EXPECT(all == "id|name|price|ok|\n"
+                "1|\"Smith, J\"|2.5|true|\n"
+                "2|Lee|\"7\"|0|\n"
+                "300||x|\n");
+  EXPECT(doc.row(3).size() == 3 && doc[2][1] == "Lee");
+  EXPECT(doc[3].index() == 3);
+
+  // A short row gives an empty cell in the column
+  auto column = doc.column(3);
+  EXPECT(column.size() == 4 && column.end() - column.begin() == 4);
+  std::string ok;
+  for (std::string_view cell : column) {
+    ok.append(cell);
+    ok.push_back('|');
+  }
+  EXPECT(ok == "ok|true|0||");
+
+  // Moving hands over the tree
+  CsvType *tree = doc.handle();
+  CsvDocument moved(std::move(doc));
+  EXPECT(!doc && moved.handle() == tree && moved.rows() == 4);
+  CsvDocument other;
+  EXPECT(!other && other.rows() == 0 && other.cell(0, 0).empty());
+  other = std::move(moved);
+  EXPECT(!moved && other.handle() == tree);
+  EXPECT(other.stats().rows == 4);
+
+  // The same cells from a snapshot
+  char snapPath[520];
+  snprintf(snapPath, sizeof(snapPath), "%s.snap", path);
+  EXPECT(csvSaveSnapshot(other.handle(), snapPath));
+  CsvDocument snap = CsvDocument::OpenSnapshot(snapPath);
+  EXPECT((bool)snap && snap.rows() == 4);
+  EXPECT(snap.unescaped(1, 1) == "Smith, J" && snap.get<int>(3, 0) == 300);
+  remove(snapPath);
+}
+
+static void checkDocumentOptions() {
+  char path[512];
+  writeFile(path, sizeof(path), "semi.csv", "a; 'b;c' \n d ;e\n");
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.dialect.separator = ';';
+  opts.dialect.quote = '\'';
+  opts.dialect.trim = true;
+  CsvDocument doc(path, opts);
+  EXPECT(doc.rows() == 2 && doc.cols() == 2);
+  EXPECT(doc.unescaped(0, 1) == "b;c");
+  EXPECT(doc.cell(1, 0) == "d" && doc.cell(1, 1) == "e");
+  remove(path);
+
+  CsvDocument missing("/nonexistent/csvDocumentTest.csv");
+  EXPECT(missing.rows() == 0);
+}
+
+////////////////////////////////////////////////////
+// The older CsvClass
+////////////////////////////////////////////////////
+static void checkCsvClass(const char *path) {
+  CsvClass csvClass;
+  EXPECT(csvClass.NumRows() == 0);
+  EXPECT(csvClass.GetCell(0, 0).status == missingRow);
+  EXPECT(csvClass.ReadCsv(path, ','));
+  EXPECT(csvClass.NumRows() == 4 && csvClass.NumCols() == 4);
+  CsvCellType cell = csvClass.GetCell(2, 1);
+  EXPECT(cell.status == normalCell && cell.bytes == 3 &&
+         memcmp(cell.cellContents, "Lee", 3) == 0);
+  EXPECT(!cell.lastCellInRow && csvClass.GetCell(2, 3).lastCellInRow);
+  EXPECT(csvClass.GetCell(3, 1).status == emptyCell);
+  EXPECT(csvClass.GetCell(3, 3).status == missingCol);
+  EXPECT(csvClass.GetCell(4, 0).status == missingRow);
+  EXPECT(csvClass.Stats().cells == 15);
+
+  CsvClass moved(std::move(csvClass));
+  EXPECT(csvClass.NumRows() == 0 && moved.NumRows() == 4);
+  // Reading again replaces the file
+  char other[512];
+  writeFile(other, sizeof(other), "other.csv", "x\ny\n");
+  EXPECT(moved.ReadCsv(other, ','));
+  EXPECT(moved.NumRows() == 2 && moved.NumCols() == 1);
+  remove(other);
+}
+
+int main() {
+  const char *tmp = getenv("TMPDIR");
+  if (tmp != nullptr && strlen(tmp) < sizeof(tempDir)) {
+    strcpy(tempDir, tmp);
+  }
+  char path[512];
+  writeFile(path, sizeof(path), "sample.csv", sample);
+  checkDocument(path);
+  checkDocumentOptions();
+  checkCsvClass(path);
+  remove(path);
+  printf("%u checks failed\n", failures);
+  return failures == 0 ? 0 : 1;
+}
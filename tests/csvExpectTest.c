@@ -0,0 +1,812 @@
+/***************************************
+MIT License
+See LICENCE at https://github.com/ChrisMcGowanAu/csvParser
+Copyright (c) 2024 Chris McGowan
+***************************************/
+
+////////////////////////////////////////////////////
+// Expected results.
+// csvDiffTest only checks that every way of loading a file agrees,
+// which can not catch an answer they all get wrong. These checks load
+// small files written here and compare with answers worked out by hand.
+//
+//   csvExpectTest           run every check, exit 1 if any fail
+////////////////////////////////////////////////////
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "csvParser.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char tempDir[256] = "/tmp";
+static uint32_t failures = 0;
+
+#define EXPECT(cond)                                                           \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond);        \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+// Write text to a file of this process in tempDir, its path in path
+static void writeFile(char *path, size_t pathSize, const char *name,
+                      const char *text, size_t len) {
+  snprintf(path, pathSize, "%s/csvExpectTest.%ld.%s", tempDir, (long)getpid(),
+           name);
+  FILE *fp = fopen(path, "wb");
+  if (fp == nullptr) {
+    fprintf(stderr, "Unable to write %s\n", path);
+    exit(1);
+  }
+  fwrite(text, 1, len, fp);
+  fclose(fp);
+}
+
+static CsvType *loadBytes(const char *text, size_t len,
+                          const CsvOptions *opts) {
+  char path[512];
+  writeFile(path, sizeof(path), "csv", text, len);
+  CsvOptions defaults;
+  if (opts == nullptr) {
+    csvDefaultOptions(&defaults);
+    opts = &defaults;
+  }
+  CsvType *csv = readCsvOptions(path, opts);
+  remove(path);
+  return csv;
+}
+
+static CsvType *loadText(const char *text, const CsvOptions *opts) {
+  return loadBytes(text, strlen(text), opts);
+}
+
+// Is the cell at row, col exactly text?
+static bool cellIs(CsvType *csv, uint32_t row, uint32_t col, const char *text) {
+  CsvCellType cell = getCell(csv, row, col);
+  if (cell.status == emptyCell) {
+    return text[0] == '\0';
+  }
+  return cell.status == normalCell && cell.bytes == strlen(text) &&
+         memcmp(cell.cellContents, text, cell.bytes) == 0;
+}
+
+// Is the cell at row, col, without its quotes, exactly text?
+static bool unescapedIs(CsvType *csv, uint32_t row, uint32_t col,
+                        const char *text) {
+  CsvCellType cell = getCell(csv, row, col);
+  char out[64];
+  return csvUnescapeCell(&cell, out, sizeof(out)) == strlen(text) &&
+         strcmp(out, text) == 0;
+}
+
+// Is column col, row by row, the '|' separated list in want?
+static bool columnIs(CsvType *csv, uint32_t col, const char *want) {
+  uint32_t row = 0;
+  const char *start = want;
+  for (;;) {
+    const char *end = strchr(start, '|');
+    size_t len = end ? (size_t)(end - start) : strlen(start);
+    char text[64];
+    if (len >= sizeof(text)) {
+      return false;
+    }
+    memcpy(text, start, len);
+    text[len] = '\0';
+    if (!cellIs(csv, row++, col, text)) {
+      fprintf(stderr, "row %u of col %u is not \"%s\"\n", row - 1, col, text);
+      return false;
+    }
+    if (end == nullptr) {
+      return row == numRows(csv);
+    }
+    start = end + 1;
+  }
+}
+
+////////////////////////////////////////////////////
+// Hash index lookups and joins
+////////////////////////////////////////////////////
+static void checkLookupAndJoin(void) {
+  CsvType *customers = loadText("C1,Ann\nC2,Bob\nC3,Cat\nC2,Bea\n", nullptr);
+  CsvType *orders = loadText("o1,C2\no2,C9\no3,C1\no4,C2\n", nullptr);
+  CsvHashIndex *index = csvBuildHashIndex(customers, 0);
+  EXPECT(index != nullptr);
+
+  uint32_t rows[4] = {0, 0, 0, 0};
+  EXPECT(csvLookup(index, "C2", rows, 4) == 2);
+  EXPECT(rows[0] == 1 && rows[1] == 3);
+  EXPECT(cellIs(customers, rows[0], 1, "Bob"));
+  EXPECT(csvLookup(index, "C3", rows, 4) == 1 && rows[0] == 2);
+  EXPECT(csvLookup(index, "C9", rows, 4) == 0);
+  // Only maxRowIds are filled, the count is still all of them
+  rows[1] = 99;
+  EXPECT(csvLookup(index, "C2", rows, 1) == 2 && rows[1] == 99);
+
+  uint64_t nPairs = 0;
+  CsvRowPair *pairs = csvJoin(orders, 1, index, &nPairs);
+  EXPECT(pairs != nullptr && nPairs == 5);
+  if (pairs != nullptr && nPairs == 5) {
+    const CsvRowPair want[5] = {{0, 1}, {0, 3}, {2, 0}, {3, 1}, {3, 3}};
+    for (uint32_t p = 0; p < 5; p++) {
+      EXPECT(pairs[p].leftRow == want[p].leftRow &&
+             pairs[p].rightRow == want[p].rightRow);
+    }
+  }
+  free(pairs);
+  // No matches is an empty result, not a failure
+  CsvType *strangers = loadText("o9,C7\no8,C8\n", nullptr);
+  nPairs = 99;
+  pairs = csvJoin(strangers, 1, index, &nPairs);
+  EXPECT(pairs != nullptr && nPairs == 0);
+  free(pairs);
+  freeMem(strangers);
+  csvFreeHashIndex(index);
+  freeMem(orders);
+  freeMem(customers);
+}
+
+////////////////////////////////////////////////////
+// Row sorts
+////////////////////////////////////////////////////
+static void checkSortRows(void) {
+  const char *text = "a,10\nb,x\nc,-2.5\nd,10\ne,3e1\nf,\ng,7\n";
+  CsvType *csv = loadText(text, nullptr);
+  CsvSortKey key = {1, csvSortNumeric, false};
+  EXPECT(csvSortRows(csv, &key, 1));
+  // Stable, and cells that are not numbers last
+  EXPECT(columnIs(csv, 0, "c|g|a|d|e|b|f"));
+  freeMem(csv);
+
+  csv = loadText(text, nullptr);
+  key.descending = true;
+  EXPECT(csvSortRows(csv, &key, 1));
+  // Still stable, and the cells that are not numbers still last
+  EXPECT(columnIs(csv, 0, "e|a|d|g|c|b|f"));
+  EXPECT(columnIs(csv, 1, "3e1|10|10|7|-2.5|x|"));
+  freeMem(csv);
+
+  csv = loadText("x,2,b\ny,1,a\nx,1,c\ny,2,d\nx,1,a\n", nullptr);
+  CsvSortKey keys[2] = {{0, csvSortString, true}, {1, csvSortNumeric, false}};
+  EXPECT(csvSortRows(csv, keys, 2));
+  EXPECT(columnIs(csv, 2, "a|d|c|a|b"));
+  freeMem(csv);
+
+  // Quoted numbers are numbers, a number followed by text is not
+  csv = loadText("a,12\nb,12abc\nc,\"3\"\nd,\"1\"\"\"\ne,\"-4.5\"\nf,12\n",
+                 nullptr);
+  key.descending = false;
+  EXPECT(csvSortRows(csv, &key, 1));
+  EXPECT(columnIs(csv, 0, "e|c|a|f|b|d"));
+  freeMem(csv);
+
+  // Byte order, so upper case first and "10" before "9"
+  csv = loadText("pear\nApple\n10\napple\n9\n", nullptr);
+  key.col = 0;
+  key.type = csvSortString;
+  key.descending = false;
+  EXPECT(csvSortRows(csv, &key, 1));
+  EXPECT(columnIs(csv, 0, "10|9|Apple|apple|pear"));
+  freeMem(csv);
+}
+
+////////////////////////////////////////////////////
+// Error policies and the error log
+////////////////////////////////////////////////////
+static bool onlyError(CsvType *csv, CsvErrorKind kind, uint64_t row,
+                      uint64_t byteOffset) {
+  uint32_t nErrors = 0;
+  uint64_t totalErrors = 0;
+  const CsvError *errors = csvGetErrors(csv, &nErrors, &totalErrors);
+  return nErrors == 1 && totalErrors == 1 && errors[0].kind == kind &&
+         errors[0].row == row && errors[0].byteOffset == byteOffset;
+}
+
+static void checkErrorPolicies(void) {
+  const char *badUtf8 = "a,1\nb,\xff\nc,3\nd,4\n";
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.validateUtf8 = true;
+  CsvType *csv = loadText(badUtf8, &opts);
+  EXPECT(columnIs(csv, 0, "a|b|c|d"));
+  EXPECT(getCell(csv, 1, 1).flags & CSV_CELL_INVALID_UTF8);
+  EXPECT(onlyError(csv, csvErrorInvalidUtf8, 1, 4));
+  freeMem(csv);
+
+  opts.errorPolicy = csvSkipRecord;
+  csv = loadText(badUtf8, &opts);
+  EXPECT(columnIs(csv, 0, "a|c|d"));
+  EXPECT(onlyError(csv, csvErrorInvalidUtf8, 1, 4));
+  freeMem(csv);
+
+  opts.errorPolicy = csvStrict;
+  csv = loadText(badUtf8, &opts);
+  EXPECT(columnIs(csv, 0, "a"));
+  EXPECT(onlyError(csv, csvErrorInvalidUtf8, 1, 4));
+  freeMem(csv);
+
+  // The quote opened on line b is never closed
+  const char *openQuote = "a,1\nb,\"oops\nc,3\n";
+  csvDefaultOptions(&opts);
+  csv = loadText(openQuote, &opts);
+  EXPECT(columnIs(csv, 0, "a"));
+  EXPECT(onlyError(csv, csvErrorUnterminatedQuote, 1, 4));
+  freeMem(csv);
+
+  opts.errorPolicy = csvSkipRecord;
+  csv = loadText(openQuote, &opts);
+  EXPECT(columnIs(csv, 0, "a|c"));
+  EXPECT(onlyError(csv, csvErrorUnterminatedQuote, 1, 4));
+  freeMem(csv);
+
+  opts.errorPolicy = csvStrict;
+  csv = loadText(openQuote, &opts);
+  EXPECT(columnIs(csv, 0, "a"));
+  EXPECT(onlyError(csv, csvErrorUnterminatedQuote, 1, 4));
+  freeMem(csv);
+
+  // Only maxErrors are kept, all are counted
+  csvDefaultOptions(&opts);
+  opts.validateUtf8 = true;
+  opts.errorPolicy = csvSkipRecord;
+  opts.maxErrors = 2;
+  csv = loadText("\xfe\nok\n\xfe\n\xfe\nend\n", &opts);
+  EXPECT(columnIs(csv, 0, "ok|end"));
+  uint32_t nErrors = 0;
+  uint64_t totalErrors = 0;
+  const CsvError *errors = csvGetErrors(csv, &nErrors, &totalErrors);
+  EXPECT(nErrors == 2 && totalErrors == 3);
+  EXPECT(errors[0].byteOffset == 0 && errors[1].byteOffset == 5);
+  freeMem(csv);
+
+  csv = loadText("a,1\n", &opts);
+  csvGetErrors(csv, &nErrors, &totalErrors);
+  EXPECT(nErrors == 0 && totalErrors == 0);
+  freeMem(csv);
+}
+
+////////////////////////////////////////////////////
+// Row ranges and samples. Each row holds its own row number.
+////////////////////////////////////////////////////
+static bool sameRows(CsvType *a, CsvType *b) {
+  if (numRows(a) != numRows(b)) {
+    return false;
+  }
+  for (uint32_t r = 0; r < numRows(a); r++) {
+    if (strtoul(getCell(a, r, 0).cellContents, nullptr, 10) !=
+        strtoul(getCell(b, r, 0).cellContents, nullptr, 10)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void checkRangeAndSample(void) {
+  const uint32_t nRows = 4000;
+  char *text = (char *)malloc(nRows * 16);
+  size_t len = 0;
+  for (uint32_t r = 0; r < nRows; r++) {
+    len += (size_t)sprintf(text + len, "%u,row\n", r);
+  }
+  char path[512];
+  writeFile(path, sizeof(path), "sample.csv", text, len);
+  free(text);
+
+  CsvType *range = readCsvRange(path, 10, 5);
+  EXPECT(columnIs(range, 0, "10|11|12|13|14"));
+  freeMem(range);
+  range = readCsvRange(path, nRows - 2, 5);
+  EXPECT(columnIs(range, 0, "3998|3999"));
+  freeMem(range);
+  range = readCsvRange(path, nRows, 5);
+  EXPECT(numRows(range) == 0);
+  freeMem(range);
+
+  // About half, in file order, and the same rows again for the seed
+  CsvType *sample = readCsvSample(path, 0.5, 7);
+  uint32_t kept = numRows(sample);
+  EXPECT(kept > nRows * 4 / 10 && kept < nRows * 6 / 10);
+  bool ordered = true;
+  unsigned long last = 0;
+  for (uint32_t r = 0; r < kept; r++) {
+    CsvCellType cell = getCell(sample, r, 0);
+    unsigned long row = strtoul(cell.cellContents, nullptr, 10);
+    ordered = ordered && (r == 0 || row > last) && row < nRows &&
+              cellIs(sample, r, 1, "row");
+    last = row;
+  }
+  EXPECT(ordered);
+  CsvType *again = readCsvSample(path, 0.5, 7);
+  EXPECT(sameRows(sample, again));
+  freeMem(again);
+  CsvType *other = readCsvSample(path, 0.5, 8);
+  EXPECT(!sameRows(sample, other));
+  freeMem(other);
+
+  // A row index changes how rows are found, not which
+  EXPECT(csvBuildRowIndex(path, nullptr));
+  again = readCsvSample(path, 0.5, 7);
+  EXPECT(sameRows(sample, again));
+  freeMem(again);
+  range = readCsvRange(path, 3000, 3);
+  EXPECT(columnIs(range, 0, "3000|3001|3002"));
+  freeMem(range);
+  freeMem(sample);
+
+  sample = readCsvSample(path, 0.0, 7);
+  EXPECT(numRows(sample) == 0);
+  freeMem(sample);
+  sample = readCsvSample(path, 1.0, 7);
+  EXPECT(numRows(sample) == nRows);
+  freeMem(sample);
+
+  char indexPath[520];
+  snprintf(indexPath, sizeof(indexPath), "%s.csvidx", path);
+  remove(indexPath);
+  remove(path);
+}
+
+////////////////////////////////////////////////////
+// Dialects
+////////////////////////////////////////////////////
+static void checkDialects(void) {
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.dialect.separator = ';';
+  opts.dialect.quote = '\'';
+  CsvType *csv = loadText("a;'b;c';\"d\"\n'e\nf';'it''s';h\n", &opts);
+  // Cells keep their quotes, csvUnescapeCell() drops them
+  EXPECT(columnIs(csv, 1, "'b;c'|'it''s'"));
+  EXPECT(unescapedIs(csv, 0, 1, "b;c"));
+  EXPECT(unescapedIs(csv, 1, 0, "e\nf"));
+  EXPECT(unescapedIs(csv, 1, 1, "it's"));
+  // A " is only text now
+  EXPECT(unescapedIs(csv, 0, 2, "\"d\""));
+  EXPECT(columnIs(csv, 2, "\"d\"|h"));
+  freeMem(csv);
+
+  csvDefaultOptions(&opts);
+  opts.dialect.trim = true;
+  csv = loadText("  a  ,\t12 \n b c ,\n", &opts);
+  EXPECT(columnIs(csv, 0, "a|b c"));
+  EXPECT(columnIs(csv, 1, "12|"));
+  EXPECT(!(getCell(csv, 0, 1).flags & CSV_CELL_DIGITS));
+  freeMem(csv);
+
+  // CR-LF line ends, and a CR kept when only LF ends lines
+  csvDefaultOptions(&opts);
+  csv = loadText("a,b\r\nc,d\r\n", &opts);
+  EXPECT(columnIs(csv, 1, "b|d"));
+  freeMem(csv);
+  opts.dialect.crlf = false;
+  csv = loadText("a,b\r\nc,d\r\n", &opts);
+  EXPECT(columnIs(csv, 1, "b\r|d\r"));
+  freeMem(csv);
+
+  // Excel's smart quotes, and the same bytes as text without them
+  csvDefaultOptions(&opts);
+  const char *smart = "\xe2\x80\x9cx,y\xe2\x80\x9d,z\n";
+  csv = loadText(smart, &opts);
+  EXPECT(columnIs(csv, 0, "\xe2\x80\x9cx,y\xe2\x80\x9d"));
+  EXPECT(columnIs(csv, 1, "z"));
+  freeMem(csv);
+  opts.dialect.smartQuotes = false;
+  csv = loadText(smart, &opts);
+  EXPECT(columnIs(csv, 0, "\xe2\x80\x9cx"));
+  EXPECT(columnIs(csv, 2, "z"));
+  freeMem(csv);
+}
+
+////////////////////////////////////////////////////
+// Byte order marks and UTF-16
+////////////////////////////////////////////////////
+static void checkEncodings(void) {
+  CsvType *csv = loadText("\xef\xbb\xbfid,x\n1,2\n", nullptr);
+  EXPECT(columnIs(csv, 0, "id|1"));
+  freeMem(csv);
+
+  // a,U+00E9 / b,U+1F600 / c,an unpaired surrogate
+  const char le[] = "\xff\xfe"
+                    "a\0,\0\xe9\0\n\0"
+                    "b\0,\0\x3d\xd8\x00\xde\n\0"
+                    "c\0,\0\x00\xdc\n\0";
+  const char be[] = "\xfe\xff"
+                    "\0a\0,\0\xe9\0\n"
+                    "\0b\0,\xd8\x3d\xde\x00\0\n"
+                    "\0c\0,\xdc\x00\0\n";
+  const char *utf8 = "\xc3\xa9|\xf0\x9f\x98\x80|\xef\xbf\xbd";
+  csv = loadBytes(le, sizeof(le) - 1, nullptr);
+  EXPECT(columnIs(csv, 0, "a|b|c"));
+  EXPECT(columnIs(csv, 1, utf8));
+  freeMem(csv);
+  csv = loadBytes(be, sizeof(be) - 1, nullptr);
+  EXPECT(columnIs(csv, 0, "a|b|c"));
+  EXPECT(columnIs(csv, 1, utf8));
+  freeMem(csv);
+
+  // Forced, with and without its own byte order mark
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.encoding = csvEncodingUtf16LE;
+  csv = loadBytes(le, sizeof(le) - 1, &opts);
+  EXPECT(columnIs(csv, 1, utf8));
+  freeMem(csv);
+  csv = loadBytes(le + 2, sizeof(le) - 3, &opts);
+  EXPECT(columnIs(csv, 0, "a|b|c"));
+  EXPECT(columnIs(csv, 1, utf8));
+  freeMem(csv);
+
+  // A forced encoding keeps any other mark as text
+  opts.encoding = csvEncodingUtf8;
+  opts.validateUtf8 = true;
+  csv = loadText("\xff\xfeid\n", &opts);
+  EXPECT(cellIs(csv, 0, 0, "\xff\xfeid"));
+  EXPECT(getCell(csv, 0, 0).flags & CSV_CELL_INVALID_UTF8);
+  freeMem(csv);
+}
+
+////////////////////////////////////////////////////
+// Parallel and background frees give back everything that was taken
+////////////////////////////////////////////////////
+static uint64_t liveBlocks = 0;
+
+static void *countAlloc(void *ctx, size_t bytes) {
+  (void)ctx;
+  __atomic_add_fetch(&liveBlocks, 1, __ATOMIC_RELAXED);
+  return malloc(bytes);
+}
+
+static void *countRealloc(void *ctx, void *ptr, size_t bytes) {
+  (void)ctx;
+  if (ptr == nullptr) {
+    __atomic_add_fetch(&liveBlocks, 1, __ATOMIC_RELAXED);
+  }
+  return realloc(ptr, bytes);
+}
+
+static void countFree(void *ctx, void *ptr) {
+  (void)ctx;
+  if (ptr != nullptr) {
+    __atomic_sub_fetch(&liveBlocks, 1, __ATOMIC_RELAXED);
+  }
+  free(ptr);
+}
+
+static void checkFrees(void) {
+  const uint32_t nRows = 20000;
+  char *text = (char *)malloc(nRows * 24);
+  size_t len = 0;
+  for (uint32_t r = 0; r < nRows; r++) {
+    len += (size_t)sprintf(text + len, "%u,\"q,%u\",%s\n", r, r % 7,
+                           (r % 2) ? "odd" : "even");
+  }
+  text[len] = '\0';
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.allocator.alloc = countAlloc;
+  opts.allocator.realloc = countRealloc;
+  opts.allocator.free = countFree;
+  const uint32_t dictCols[1] = {2};
+  opts.dictCols = dictCols;
+  opts.nDictCols = 1;
+
+  CsvType *csv = loadText(text, &opts);
+  EXPECT(numRows(csv) == nRows && liveBlocks > nRows);
+  freeMemParallel(csv);
+  EXPECT(liveBlocks == 0);
+
+  // Several trees queued at once, all gone after the wait
+  for (uint32_t n = 0; n < 3; n++) {
+    csv = loadText(text, &opts);
+    EXPECT(numRows(csv) == nRows);
+    freeMemAsync(csv);
+  }
+  csvWaitForFrees();
+  EXPECT(liveBlocks == 0);
+  // Nothing queued returns at once
+  csvWaitForFrees();
+  freeMemAsync(nullptr);
+  freeMemParallel(nullptr);
+  csvWaitForFrees();
+  free(text);
+}
+
+////////////////////////////////////////////////////
+// Hot reloading
+////////////////////////////////////////////////////
+static void checkHandleReload(void) {
+  char path[512];
+  writeFile(path, sizeof(path), "reload.csv", "v1,a\n", 5);
+  CsvHandle *handle = csvHandleOpen(path, nullptr);
+  EXPECT(handle != nullptr);
+  if (handle == nullptr) {
+    remove(path);
+    return;
+  }
+  EXPECT(csvHandleVersion(handle) == 1);
+  CsvHandleRef ref = csvHandleAcquire(handle);
+  EXPECT(columnIs(ref.csv, 0, "v1"));
+
+  // A reader holding the old version keeps it while the new one loads
+  writeFile(path, sizeof(path), "reload.csv", "v2,a\nv2,b\n", 10);
+  EXPECT(csvHandleReload(handle));
+  EXPECT(columnIs(ref.csv, 0, "v1"));
+  csvHandleRelease(handle, ref);
+  EXPECT(csvHandleWaitReload(handle));
+  EXPECT(csvHandleVersion(handle) == 2);
+  ref = csvHandleAcquire(handle);
+  EXPECT(columnIs(ref.csv, 1, "a|b"));
+  csvHandleRelease(handle, ref);
+
+  // A reload that can not read the file keeps the version there is
+  remove(path);
+  EXPECT(csvHandleReload(handle));
+  EXPECT(!csvHandleWaitReload(handle));
+  EXPECT(csvHandleVersion(handle) == 2);
+  ref = csvHandleAcquire(handle);
+  EXPECT(columnIs(ref.csv, 0, "v2|v2"));
+  csvHandleRelease(handle, ref);
+  csvHandleClose(handle);
+
+  EXPECT(csvHandleOpen(path, nullptr) == nullptr);
+}
+
+////////////////////////////////////////////////////
+// Arrow export types. Only plain decimals make a float64 column.
+////////////////////////////////////////////////////
+// Is row of a utf8 Arrow column exactly text?
+static bool arrowTextIs(const struct ArrowArray *array, uint32_t row,
+                        const char *text) {
+  const int32_t *offsets = (const int32_t *)array->buffers[1];
+  const char *data = (const char *)array->buffers[2];
+  return (size_t)(offsets[row + 1] - offsets[row]) == strlen(text) &&
+         memcmp(&data[offsets[row]], text, strlen(text)) == 0;
+}
+
+static void checkArrowTypes(void) {
+  CsvType *csv = loadText("n,f,hex,big,inf,sp\n"
+                          "12,1.5,0x10,1e999,inf, 3\n"
+                          "-7,-2e3,12,2,4,4\n",
+                          nullptr);
+  struct ArrowSchema schema;
+  struct ArrowArray array;
+  EXPECT(csvToArrow(csv, true, true, &schema, &array));
+  EXPECT(array.length == 2 && array.n_children == 6);
+  EXPECT(strcmp(schema.children[0]->format, "l") == 0);
+  EXPECT(((const int64_t *)array.children[0]->buffers[1])[1] == -7);
+  EXPECT(strcmp(schema.children[1]->format, "g") == 0);
+  EXPECT(((const double *)array.children[1]->buffers[1])[0] == 1.5);
+  EXPECT(((const double *)array.children[1]->buffers[1])[1] == -2000.0);
+  // Hex, out of range, inf and leading spaces keep their text
+  const char *kept[4] = {"0x10", "1e999", "inf", " 3"};
+  for (uint32_t c = 2; c < 6; c++) {
+    EXPECT(strcmp(schema.children[c]->format, "u") == 0);
+    EXPECT(arrowTextIs(array.children[c], 0, kept[c - 2]));
+  }
+  EXPECT(arrowTextIs(array.children[2], 1, "12"));
+  array.release(&array);
+  schema.release(&schema);
+  freeMem(csv);
+}
+
+////////////////////////////////////////////////////
+// Damaged snapshots are refused. The offsets are those of SnapHeader
+// and the tables after it in csvParser.c.
+////////////////////////////////////////////////////
+#define SNAP_NCELLS 32
+#define SNAP_CELLS 48
+#define SNAP_DATA 56
+#define SNAP_FILEBYTES 64
+#define SNAP_ROWS 72
+
+static uint64_t snapWord(const char *snap, size_t at) {
+  uint64_t value;
+  memcpy(&value, &snap[at], sizeof(value));
+  return value;
+}
+
+static void setSnapWord(char *snap, size_t at, uint64_t value) {
+  memcpy(&snap[at], &value, sizeof(value));
+}
+
+// Does a copy of snap with one word changed, or cut to len, open?
+static bool damagedOpens(const char *snap, size_t len, size_t at,
+                         uint64_t value) {
+  char *copy = (char *)malloc(len);
+  memcpy(copy, snap, len);
+  if (at + sizeof(value) <= len) {
+    setSnapWord(copy, at, value);
+  }
+  char path[512];
+  writeFile(path, sizeof(path), "bad.snap", copy, len);
+  free(copy);
+  CsvType *csv = csvOpenSnapshot(path);
+  remove(path);
+  bool opened = (csv != nullptr);
+  freeMem(csv);
+  return opened;
+}
+
+static void checkDamagedSnapshots(void) {
+  CsvType *csv = loadText("ab,c\nd,\ne,fg,h\n", nullptr);
+  char path[512];
+  snprintf(path, sizeof(path), "%s/csvExpectTest.%ld.snap", tempDir,
+           (long)getpid());
+  EXPECT(csvSaveSnapshot(csv, path));
+  freeMem(csv);
+  FILE *fp = fopen(path, "rb");
+  char snap[4096];
+  size_t len = fp ? fread(snap, 1, sizeof(snap), fp) : 0;
+  if (fp != nullptr) {
+    fclose(fp);
+  }
+  remove(path);
+  EXPECT(len > SNAP_ROWS && snapWord(snap, SNAP_FILEBYTES) == len);
+  if (len <= SNAP_ROWS || snapWord(snap, SNAP_FILEBYTES) != len) {
+    return;
+  }
+  uint64_t nCells = snapWord(snap, SNAP_NCELLS);
+  size_t cells = (size_t)snapWord(snap, SNAP_CELLS);
+  uint64_t dataOffset = snapWord(snap, SNAP_DATA);
+  EXPECT(nCells == 7);
+  // Each cell is {offset, bytes, flags}, 16 bytes
+  uint64_t firstText = snapWord(snap, cells);
+  EXPECT(firstText == dataOffset && memcmp(&snap[firstText], "ab", 3) == 0);
+
+  EXPECT(damagedOpens(snap, len, len, 0));
+  // A row past the last cell, then rows going backwards
+  EXPECT(!damagedOpens(snap, len, SNAP_ROWS + 8, nCells + 1));
+  EXPECT(!damagedOpens(snap, len, SNAP_ROWS + 8, nCells));
+  // Cell text before the text area, past the end, and without its '\0'
+  EXPECT(!damagedOpens(snap, len, cells, 8));
+  EXPECT(!damagedOpens(snap, len, cells, len));
+  EXPECT(!damagedOpens(snap, len, cells + 8, 3));
+  EXPECT(!damagedOpens(snap, len, cells + 8, UINT32_MAX));
+  // A cell count whose table size overflows to the real one
+  EXPECT(!damagedOpens(snap, len, SNAP_NCELLS, nCells + (1ULL << 60)));
+  // Cut short, with the header saying so
+  snap[len - 1] = 'x';
+  setSnapWord(snap, SNAP_FILEBYTES, len - 1);
+  EXPECT(!damagedOpens(snap, len - 1, len, 0));
+  EXPECT(!damagedOpens(snap, len - 1, SNAP_FILEBYTES, len));
+}
+
+////////////////////////////////////////////////////
+// Cell flags
+////////////////////////////////////////////////////
+static void checkCellFlags(void) {
+  const char *text = "123,\"ab\",\"a\"\"b\",\"x\ny\",\"p,q\","
+                     "a\"b\"c,\"\",,-1\n";
+  const uint8_t want[9] = {
+      CSV_CELL_DIGITS,
+      CSV_CELL_QUOTED,
+      CSV_CELL_QUOTED | CSV_CELL_ESCAPED_QUOTES,
+      CSV_CELL_QUOTED | CSV_CELL_NEWLINE,
+      CSV_CELL_QUOTED | CSV_CELL_SEPARATOR,
+      0, // a quote in an unquoted cell is not an escaped quote
+      CSV_CELL_QUOTED,
+      0,
+      0};
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  // The comma loop and the generic one
+  for (uint32_t generic = 0; generic < 2; generic++) {
+    opts.genericParser = generic;
+    CsvType *csv = loadText(text, &opts);
+    EXPECT(numRows(csv) == 1 && numCols(csv) == 9);
+    EXPECT(cellIs(csv, 0, 5, "a\"b\"c"));
+    for (uint32_t c = 0; c < 9; c++) {
+      CsvCellType cell = getCell(csv, 0, c);
+      if (cell.flags != want[c]) {
+        fprintf(stderr, "col %u flags 0x%x not 0x%x\n", c, cell.flags,
+                want[c]);
+      }
+      EXPECT(cell.flags == want[c]);
+    }
+    freeMem(csv);
+  }
+
+  // Excel's quotes
+  CsvType *csv = loadText("\xe2\x80\x9cs,t\xe2\x80\x9d,"
+                          "\xe2\x80\x9cu\xe2\x80\x9d\n",
+                          nullptr);
+  EXPECT(numRows(csv) == 1 && numCols(csv) == 2);
+  EXPECT(getCell(csv, 0, 0).flags ==
+         (CSV_CELL_SMART_QUOTED | CSV_CELL_SEPARATOR));
+  EXPECT(getCell(csv, 0, 1).flags == CSV_CELL_SMART_QUOTED);
+  freeMem(csv);
+}
+
+////////////////////////////////////////////////////
+// Dictionary encoded columns. Codes go in order of first appearance.
+////////////////////////////////////////////////////
+static void checkDictionary(void) {
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  const uint32_t dictCols[1] = {1};
+  opts.dictCols = dictCols;
+  opts.nDictCols = 1;
+  CsvType *csv = loadText("1,GB\n2,FR\n3,GB\n4,\n5\n6,DE\n7,FR\n8,\n", &opts);
+  uint32_t nCodes = 0;
+  const uint32_t *codes = csvColumnCodes(csv, 1, &nCodes);
+  const uint32_t want[8] = {0, 1, 0, 2, CSV_NO_CODE, 3, 1, 2};
+  EXPECT(codes != nullptr && nCodes == 8);
+  for (uint32_t r = 0; codes != nullptr && r < nCodes && r < 8; r++) {
+    EXPECT(codes[r] == want[r]);
+  }
+  EXPECT(csvDictSize(csv, 1) == 4);
+  EXPECT(strcmp(csvDictString(csv, 1, 0), "GB") == 0);
+  EXPECT(strcmp(csvDictString(csv, 1, 1), "FR") == 0);
+  EXPECT(strcmp(csvDictString(csv, 1, 2), "") == 0);
+  EXPECT(strcmp(csvDictString(csv, 1, 3), "DE") == 0);
+  // The cells share the dictionary's copy
+  EXPECT(getCell(csv, 0, 1).cellContents == getCell(csv, 2, 1).cellContents);
+  EXPECT(cellIs(csv, 3, 1, "") && cellIs(csv, 5, 1, "DE"));
+  EXPECT(getCell(csv, 4, 1).status == missingCol);
+  // Columns that were not encoded have no codes
+  EXPECT(csvColumnCodes(csv, 0, &nCodes) == nullptr);
+  EXPECT(csvDictSize(csv, 0) == 0);
+  freeMem(csv);
+}
+
+////////////////////////////////////////////////////
+// Load statistics
+////////////////////////////////////////////////////
+static void checkStats(void) {
+  // 4 records, two of them over several lines, and 9 cells
+  const char *text = "a,b,c\n\"x\ny\",2\nd,\n\"q\"\"r\",\"s\nt\nu\"\n";
+  CsvType *csv = loadText(text, nullptr);
+  CsvStats stats = csvGetStats(csv);
+  EXPECT(stats.bytesRead == strlen(text));
+  EXPECT(stats.rows == 4 && stats.cells == 9);
+  EXPECT(stats.multiLineRecords == 2 && stats.malformedQuotes == 0);
+  EXPECT(stats.invalidUtf8Cells == 0 && stats.badUtf16Units == 0);
+  EXPECT(stats.allocCount > 0 && stats.allocBytes > 0);
+  freeMem(csv);
+
+  // One bad cell, and a quote left open at the end
+  CsvOptions opts;
+  csvDefaultOptions(&opts);
+  opts.validateUtf8 = true;
+  csv = loadText("a,\xff\nb,c\n\"d\n", &opts);
+  stats = csvGetStats(csv);
+  EXPECT(stats.rows == 2 && stats.cells == 4);
+  EXPECT(stats.invalidUtf8Cells == 1 && stats.malformedQuotes == 1);
+  freeMem(csv);
+
+  // An unpaired surrogate, the byte order mark counts as read
+  const char le[] = "\xff\xfe" "a\0,\0\x00\xdc\n\0";
+  csv = loadBytes(le, sizeof(le) - 1, nullptr);
+  stats = csvGetStats(csv);
+  EXPECT(stats.bytesRead == sizeof(le) - 1 && stats.badUtf16Units == 1);
+  EXPECT(stats.rows == 1 && stats.cells == 2);
+  freeMem(csv);
+}
+
+int main(void) {
+  const char *tmp = getenv("TMPDIR");
+  if (tmp != nullptr && strlen(tmp) < sizeof(tempDir)) {
+    strcpy(tempDir, tmp);
+  }
+  checkLookupAndJoin();
+  checkSortRows();
+  checkErrorPolicies();
+  checkRangeAndSample();
+  checkDialects();
+  checkEncodings();
+  checkFrees();
+  checkHandleReload();
+  checkArrowTypes();
+  checkDamagedSnapshots();
+  checkCellFlags();
+  checkDictionary();
+  checkStats();
+  printf("%u checks failed\n", failures);
+  return failures == 0 ? 0 : 1;
+}